@@ -25,7 +25,11 @@ void free(void *ptr) {
 
     if(!ptr) return;
 
-    freep = dlsym(RTLD_NEXT, "free");
-
+    freep = dlsym(RTLD_NEXT, "free"); /* get address of libc free */
+    if ((error = dlerror()) != NULL) {
+        fputs(error, stderr);
+        exit(1);
+    }
+    freep(ptr);
 }
 #endif
\ No newline at end of file
@@ -21,32 +21,31 @@ no circumstances should a collector reclaim an alive object.
 
 it should not allocate objects by itself. instead it delegates this 
 generic task to the allocator module - 
-this is the topic of our discussion. */
-
-/**
- * @brief machine word size. depending on the architecture can be 4 or 8 bytes.
- */
+this is the topic of our discussion. a small incremental collector
+for objects from gcAlloc() sits at the end of the file. */
 
 #include <cstddef>
 #include <cstdint>
+#include <algorithm>
+#include <new>
 #include <utility>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
 #include <assert.h>
-using word_t = intptr_t;
+#include "mem_alloc.h"
 
 /**
  * @brief allocated block of memory. contains the object header structure
  and the actual payload pointer.
+ * the header is a single word (the packed layout): sizes are multiples
+ of the word, so the low bits of the size hold the flags. there is no
+ link to the next block, it starts right after the payload.
  */
 
 struct Block {
-    // 1. object header
-    /* block size */
-    size_t size;
-    /* whether this block is currently used. */
-    bool used;
-
-    /* next block in the list. */
-    Block *next;
+    // 1. object header: marked | size | mapped | prev used | used
+    size_t header;
 
     /**
      * @brief Payload pointer
@@ -54,12 +53,73 @@ struct Block {
     word_t data[1];
 };
 
+/* the block is currently used */
+constexpr size_t kUsed = 1;
+/* the block right before this one is used, or there is none. only a
+   free left neighbour keeps a footer to be found by. */
+constexpr size_t kPrevUsed = 2;
+/* the block has a mapping of its own (large objects) */
+constexpr size_t kMapped = 4;
+/* mark bit of the collector, the top bit: sizes stay below kMaxRequest */
+constexpr size_t kMarked = (size_t)1 << 63;
+/* the free block is on its heap's trim list, see trimHeap() */
+constexpr size_t kTrimListed = (size_t)1 << 62;
+constexpr size_t kFlags = kUsed | kPrevUsed | kMapped | kMarked | kTrimListed;
+
+/* the owner of a used block reads its size without the heap lock, while
+   the heap may flip its prev-used bit when the left neighbour changes.
+   so the word is loaded and stored as a relaxed atomic, which are plain
+   moves; only the heap, under its lock, ever writes it. */
+inline size_t getHeaderWord(Block *block) {
+    return __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+}
+
+inline void setHeader(Block *block, size_t header) {
+    __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
+}
+
+/* returns actual size */
+inline size_t getSize(Block *block) {
+    return getHeaderWord(block) & ~kFlags;
+}
+
+/* sets the size, keeping the flags */
+inline void setSize(Block *block, size_t size) {
+    setHeader(block, size | (getHeaderWord(block) & kFlags));
+}
+
+/* check if the block is being used */
+inline bool isUsed(Block *block) {
+    return getHeaderWord(block) & kUsed;
+}
+
+/* sets the used flag */
+inline void setUsed(Block *block, bool used) {
+    size_t header = getHeaderWord(block);
+    setHeader(block, used ? header | kUsed : header & ~kUsed);
+}
+
+inline bool isPrevUsed(Block *block) {
+    return getHeaderWord(block) & kPrevUsed;
+}
+
+inline void setPrevUsed(Block *block, bool used) {
+    size_t header = getHeaderWord(block);
+    setHeader(block, used ? header | kPrevUsed : header & ~kPrevUsed);
+}
+
+inline bool isMapped(Block *block) {
+    return getHeaderWord(block) & kMapped;
+}
 
-/* heap start. initialized on first allocation. */
-static Block *heapStart = nullptr;
+inline bool isMarked(Block *block) {
+    return getHeaderWord(block) & kMarked;
+}
 
-/* current top. updated on each allocation. */
-static auto top = heapStart;
+inline void setMarked(Block *block, bool marked) {
+    size_t header = getHeaderWord(block);
+    setHeader(block, marked ? header | kMarked : header & ~kMarked);
+}
 
 
 // memory alignment - for faster access, memory block should be aligned,
@@ -74,6 +134,22 @@ static auto top = heapStart;
 inline size_t align(size_t n) {
     return (n + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
 };
+
+/* rounds n up to a multiple of 'alignment', a power of two */
+inline size_t alignUp(size_t n, size_t alignment) {
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+/* alignment of every payload. a word by default; the process malloc has
+   to hand out alignof(max_align_t), build with -DMEM_ALLOC_MIN_ALIGN=16. */
+#ifndef MEM_ALLOC_MIN_ALIGN
+#define MEM_ALLOC_MIN_ALIGN 8
+#endif
+constexpr size_t kMinAlign = MEM_ALLOC_MIN_ALIGN;
+static_assert(kMinAlign >= sizeof(word_t) && (kMinAlign & (kMinAlign - 1)) == 0);
+
+/* requests above this can only fail, and would overflow the rounding */
+constexpr size_t kMaxRequest = SIZE_MAX / 4;
 // buffer of two bytes provided for alloaction - on a 32 bit
 // architecture as an example
 
@@ -102,17 +178,293 @@ inline size_t allocSize(size_t size_) {
     return size_ + sizeof(Block) - sizeof(std::declval<Block>().data);
 }
 
+// Implementation of a custom sbrk - mapping of external files
+// memory is requested. mmap can be used for both, mapping 
+// used to create anonymous mappings (not backed by any file)
+
+#include <sys/mman.h>
+
+/**
+ * @brief allocation arena for custom sbrk. arenas are chained, the
+ newest one first, and the break always moves inside the newest one.
+ * the blocks of an arena start right after this header and end with an
+ epilogue: an empty, used header word just below the break.
+ */
+
+struct Arena {
+    Arena *next;
+    size_t size;
+    bool huge;      // backed by (or advised to use) 2 MiB pages
+};
+
+ static size_t arena_size = 4 << 20;
+
+ // requests at or above this size get a mapping of their own
+ static size_t mmap_threshold = 128 << 10;
+
+ // free blocks at or above this size give their pages back to the OS
+ // when the heap is trimmed
+ static size_t trim_threshold = 64 << 10;
+
+ // frees wait in a buffer and are coalesced in batches, see heapDeferFree()
+ static std::atomic<bool> defer_frees{false};
+
+ // new arenas go on 2 MiB pages, see heapHugePages()
+ static std::atomic<bool> huge_pages{false};
+ constexpr size_t kHugePage = 2 << 20;
+
+ // looked up on first use: as the process malloc the heap already runs
+ // before the static initializers of this file
+ inline size_t pageSize() {
+     static const size_t size = sysconf(_SC_PAGESIZE);
+     return size;
+ }
+
+ // bytes of arenas and large-object mappings currently held
+ static std::atomic<size_t> mapped_bytes{0};
+
+ // bytes handed out by _sbrk plus large-object mappings
+ static std::atomic<size_t> heap_bytes{0};
+
+ // arenas and large-object mappings requested so far
+ static std::atomic<uint64_t> os_requests{0};
+
+ // bytes of arenas on huge pages
+ static std::atomic<size_t> huge_bytes{0};
+
+#include <list>
+#include <mutex>
+
+/* size classes: small sizes get one class per word, from 512 bytes on
+each power of two is cut into 4 geometric classes. */
+constexpr size_t kSmallLimit = 512;
+constexpr int kSmallShift = 9;
+constexpr int kSmallClasses = kSmallLimit / sizeof(word_t) - 1;
+constexpr int kClassSteps = 4;
+constexpr int kNumClasses = kSmallClasses + (64 - kSmallShift) * kClassSteps;
+
+constexpr size_t kBitmapLimit = 256;            // largest slot size of the runs
+constexpr int kRunClasses = kBitmapLimit / sizeof(word_t);
+
+constexpr int kDeferMax = 256;                  // frees parked before a drain
+
+struct Run;
+
+/**
+ * @brief everything one heap owns: its arenas and the free-block
+ structures of every search mode. a single-threaded heap is heaps[0]; in
+ thread-safe mode there is one heap per CPU (a shard) with a lock of its
+ own, see the shard section below.
+ * the functions of the heap work on 'heap', the shard the calling thread
+ holds.
+ */
+
+struct alignas(64) Heap {
+    std::mutex lock;
+    Arena *arena = nullptr;
+    char *brk = nullptr;
+    size_t bytes = 0;                   // handed out by _sbrk
+    size_t freedSinceTrim = 0;
+
+    Block *treeRoot = nullptr;          // best fit
+
+    /* head of the free list of each class, plus a bitmap of non-empty classes */
+    Block *segregatedLists[kNumClasses] = {};
+    uint64_t segregatedMap[(kNumClasses + 63) / 64] = {};
+
+    /* next fit: the address-ordered list and its roving pointer */
+    Block *addressHead = nullptr, *addressTail = nullptr;
+    Block *searchStart = nullptr;
+    Block *insertHint = nullptr;        // successor of the last removed block
+    bool hintSet = false;
+
+    Run *emptyRuns = nullptr;           // runs with no slot in use
+    Run *partialRuns[kRunClasses] = {};
+
+    /* free blocks of trim_threshold bytes and more not trimmed since */
+    Block *trimHead = nullptr;
+    bool hugeArenas = false;
+
+    /* blocks freed but not yet handed back to the heap, see drainFrees() */
+    word_t *deferred[kDeferMax] = {};
+    int deferredCount = 0;
+
+    /* blocks other shards freed, chained through their first word */
+    std::atomic<word_t *> remoteFrees{nullptr};
+};
+
+constexpr int kMaxShards = 64;
+
+ // shards of a thread-safe heap, 0 = one per CPU
+ static int heap_shards = 0;
+
+// constant-initialized: the heap may be the process malloc before the
+// static constructors of this file run
+constinit static Heap heaps[kMaxShards];
+static int shardCount = 1;
+static thread_local Heap *heap = &heaps[0];
+
+/* free blocks of each heap, used by the explicit free-list search */
+static std::list<Block *> free_lists[kMaxShards];
+
+inline std::list<Block *> &freeList() {
+    return free_lists[heap - heaps];
+}
+
+inline size_t pageAlign(size_t n) {
+    return (n + pageSize() - 1) & ~(pageSize() - 1);
+}
+
+/* the first block of an arena, placed so that its payload is aligned */
+inline Block *firstBlock(Arena *a) {
+    return (Block *)((char *)a + alignUp(sizeof(Arena) + sizeof(word_t), kMinAlign) -
+                     sizeof(word_t));
+}
+
+/* Huge pages -- a heap of many GiB on 4 KiB pages misses the TLB on
+almost every random access. an arena can sit on 2 MiB pages instead:
+from the hugetlb pool when the system reserved one, otherwise as a 2 MiB
+aligned mapping that madvise() hands to transparent huge pages. without
+either the arena falls back to normal pages. */
+
+/* maps 'size' bytes at a multiple of 'alignment': maps more and cuts
+   off both ends */
+void *mapAligned(size_t size, size_t alignment) {
+    char *raw = (char *)mmap(0, size + alignment, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return nullptr;
+    char *aligned = (char *)alignUp((uintptr_t)raw, alignment);
+    if (aligned != raw) munmap(raw, aligned - raw);
+    munmap(aligned + size, raw + alignment - aligned);
+    return aligned;
+}
+
+void *mapHuge(size_t size) {
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_2MB)
+    // no MAP_NORESERVE: a short pool fails here instead of with SIGBUS
+    // on first touch
+    void *mem = mmap(0, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (mem != MAP_FAILED) return mem;
+#endif
+#ifdef MADV_HUGEPAGE
+    void *aligned = mapAligned(size, kHugePage);
+    if (aligned == nullptr) return nullptr;
+    if (madvise(aligned, size, MADV_HUGEPAGE) == 0) return aligned;
+    munmap(aligned, size);
+#endif
+    return nullptr;
+}
+
+/* Arena owners -- a block freed by a thread of another shard goes back
+to the shard owning its arena. arenas start on 2 MiB boundaries, and one
+byte per 2 MiB of address space names the shard of the arena covering
+it. the table is reserved when the heap is sharded, pages of it are only
+backed where arenas are. */
+
+constexpr int kOwnerShift = 21;
+constexpr size_t kOwnerEntries = (size_t)1 << (48 - kOwnerShift);
+static uint8_t *arenaOwners = nullptr;
+
+/**
+ * @brief maps a large chunk of anonymous memory as a new arena and
+ moves the break to its beginning. pages are only backed once touched.
+ */
+
+bool newArena(size_t size) {
+    size = (size + arena_size - 1) / arena_size * arena_size;
+    void *mem = nullptr;
+    bool huge = false;
+    if (huge_pages) {
+        size = alignUp(size, kHugePage);
+        huge = (mem = mapHuge(size)) != nullptr;
+    }
+    if (!huge && (mem = mapAligned(size, (size_t)1 << kOwnerShift)) == nullptr) return false;
+    if (shardCount > 1) {
+        uintptr_t last = ((uintptr_t)mem + size - 1) >> kOwnerShift;
+        for (uintptr_t i = (uintptr_t)mem >> kOwnerShift; i <= last; ++i)
+            __atomic_store_n(&arenaOwners[i], (uint8_t)(heap - heaps), __ATOMIC_RELAXED);
+    }
+
+    mapped_bytes += size;
+    if (huge) huge_bytes += size;
+    os_requests++;
+    Arena *fresh = (Arena *)mem;
+    fresh->next = heap->arena;
+    fresh->size = size;
+    fresh->huge = huge;
+    heap->hugeArenas |= huge;
+    heap->arena = fresh;
+    heap->brk = (char *)firstBlock(fresh) + sizeof(word_t);
+    setHeader((Block *)(heap->brk - sizeof(word_t)), kUsed | kPrevUsed);
+    return true;
+}
+
+// implement our own
+void *_sbrk(intptr_t increment) {
+    // 0. pre allocate large arena using `mmap` init program break to 
+    // the beginning of this arena.
+    if (heap->arena == nullptr && !newArena(arena_size)) return (void *)-1;
+
+    // 1. if increment is 0, return current break position
+    if (increment == 0) return heap->brk;
+
+    // 2. if current + increment exceeds top of arena, return -1
+    if (heap->brk + increment > (char *)heap->arena + heap->arena->size) return (void *)-1;
+
+    // 3. otherwise, increase the program break on increment bytes
+    void *previous = heap->brk;
+    heap->brk += increment;
+    heap->bytes += increment;
+    heap_bytes += increment;
+    return previous;
+};
+
+/* unmaps all arenas, the next _sbrk starts over with a fresh one */
+void releaseArenas() {
+    while (heap->arena != nullptr) {
+        Arena *next = heap->arena->next;
+        mapped_bytes -= heap->arena->size;
+        if (heap->arena->huge) huge_bytes -= heap->arena->size;
+        munmap(heap->arena, heap->arena->size);
+        heap->arena = next;
+    }
+    heap->brk = nullptr;
+    heap->hugeArenas = false;
+    heap_bytes -= heap->bytes;
+    heap->bytes = 0;
+    heap->freedSinceTrim = 0;
+}
+
+// ----------------------------------------------------------------
+
+
+/* the empty header closing the blocks of an arena */
+inline bool isEpilogue(Block *block) {
+    return getSize(block) == 0;
+}
+
 /**
  * @brief Requests (maps) memory from OS.
+ * the block is cut from the current arena. when that one is full, the
+ heap continues in a new arena (the rest of the old one stays unused).
+ * the new block takes the place of the epilogue and a new epilogue goes
+ after it. the first block of an arena has no left neighbour, so blocks
+ of different arenas are never merged.
  */
 
 Block *requestFromOS(size_t size_) {
-    // current heap break - position of newly alloacted block
-    Block * block = (Block *)sbrk(0);
-
     // OOM - pass amt of bytes signal about OOM, out of memory, returning nullptr
     // otherwise return obtained (1) address of allocated block
-    if (sbrk(allocSize(size_)) == (void *) - 1) return nullptr;
+    if (_sbrk(allocSize(size_)) == (void *) - 1) {
+        if (!newArena(alignUp(sizeof(Arena) + sizeof(word_t), kMinAlign) + allocSize(size_)))
+            return nullptr;
+        _sbrk(allocSize(size_));
+    }
+
+    Block *block = (Block *)(heap->brk - sizeof(word_t) - allocSize(size_));
+    setHeader(block, size_ | kUsed | (getHeaderWord(block) & kPrevUsed));
+    setHeader((Block *)(heap->brk - sizeof(word_t)), kUsed | kPrevUsed);
     return block;
 }
 
@@ -127,11 +479,178 @@ Block *getHeader(word_t *data) {
 };
 
 
+/* Boundary tags -- every free block repeats its size in a footer, the
+last word of its payload. a block can then find the header of a free left
+neighbour by reading the word just before its own header, so freeing can
+merge with both neighbours in constant time instead of walking the list.
+used blocks need no footer: the prev-used bit of their right neighbour
+tells that there is nothing to merge with. */
+
+/**
+ * @brief returns the footer word of the block
+ */
+
+inline word_t *getFooter(Block *block) {
+    return (word_t *)((char *)block->data + getSize(block)) - 1;
+}
+
+/* writes the size of the free block into its footer */
+inline void setFooter(Block *block) {
+    *getFooter(block) = (word_t)getSize(block);
+}
+
+/**
+ * @brief returns the block physically after this one. blocks are found
+ by their size alone, the last one of an arena is followed by the epilogue.
+ */
+
+inline Block *nextBlock(Block *block) {
+    return (Block *)((char *)block + allocSize(getSize(block)));
+}
+
+/**
+ * @brief returns the free block physically before this one, or nullptr
+ when that one is used (or this is the first block of its arena).
+ */
+
+inline Block *prevBlock(Block *block) {
+    if (isPrevUsed(block)) return nullptr;
+    size_t prevSize = (size_t)((word_t *)block)[-1];
+    return (Block *)((char *)block - allocSize(prevSize));
+}
+
+/* marks the block used or free, and tells its right neighbour */
+inline void markUsed(Block *block, bool used) {
+    setUsed(block, used);
+    setPrevUsed(nextBlock(block), used);
+    if (!used) setFooter(block);
+}
+
+
+/* Large objects bypass the arenas: each one gets its own mapping,
+which is unmapped as soon as the object is freed. an aligned object
+starts its header as far into the first page as it takes to align the
+payload, and the block always ends where the mapping ends. */
+
+word_t *mapLarge(size_t size, size_t alignment = kMinAlign) {
+    size_t header = allocSize(0);
+    size_t offset = alignUp(header, std::min(alignment, pageSize())) - header;
+    size_t length = pageAlign(offset + allocSize(size));
+
+    // alignments past a page: map the slack too and cut it off again
+    size_t slack = alignment > pageSize() ? alignment : 0;
+    char *mem = (char *)mmap(0, length + slack, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+    if (slack != 0) {
+        char *start = (char *)alignUp((uintptr_t)mem + pageSize(), alignment) - pageSize();
+        if (start != mem) munmap(mem, start - mem);
+        if (start + length != mem + length + slack)
+            munmap(start + length, mem + slack - start);
+        mem = start;
+    }
+    mapped_bytes += length;
+    heap_bytes += length;
+    os_requests++;
+
+    Block *block = (Block *)(mem + offset);
+    setHeader(block, (length - offset - allocSize(0)) | kUsed | kPrevUsed | kMapped);
+    return block->data;
+}
+
+/* first page of the mapping of a large object */
+inline char *mappingStart(Block *block) {
+    return (char *)((uintptr_t)block & ~(pageSize() - 1));
+}
+
+void unmapLarge(Block *block) {
+    char *start = mappingStart(block);
+    size_t length = (char *)block + allocSize(getSize(block)) - start;
+    mapped_bytes -= length;
+    heap_bytes -= length;
+    munmap(start, length);
+}
+
+
+// ----------------------------------------------------------------
+
+// Statistics -- every thread counts into a slot of its own, so counting
+// is a relaxed load and store on a cache line no other thread writes.
+// reading sums all slots. the slot of an exited thread is handed to the
+// next new thread and keeps its counts, so nothing is lost on exit.
+
+#include <pthread.h>
+
+constexpr int kSizeBins = 64;    // blocks by log2 of their size
+
+using counter_t = std::atomic<uint64_t>;
+
+struct alignas(64) Counters {
+    counter_t allocs{0}, frees{0};
+    counter_t searches{0}, blocksSearched{0};
+    counter_t splits{0}, coalesces{0};
+    counter_t cacheHits{0};
+    counter_t requestedBytes{0}, allocatedBytes{0}, freedBytes{0};
+    counter_t allocsBySize[kSizeBins] = {};
+    counter_t freesBySize[kSizeBins] = {};
+
+    Counters *next = nullptr;
+    bool taken = true;
+};
+
+static std::mutex statsLock;
+static Counters *statsSlots = nullptr;
+static pthread_key_t statsKey;
+static thread_local Counters *threadCounters = nullptr;
+
+/* only the owning thread writes a counter, no read-modify-write needed */
+inline void count(counter_t &counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+inline int sizeBin(size_t size) {
+    return size ? 63 - __builtin_clzll(size) : 0;
+}
+
+/* runs when a thread exits, after its thread caches were flushed */
+void releaseCounters(void *slot) {
+    std::lock_guard<std::mutex> guard(statsLock);
+    ((Counters *)slot)->taken = false;
+}
+
+/* slots are mapped directly, the allocator may be the process malloc */
+Counters &claimCounters() {
+    static bool keyCreated = pthread_key_create(&statsKey, releaseCounters) == 0;
+    std::lock_guard<std::mutex> guard(statsLock);
+
+    Counters *slot = statsSlots;
+    while (slot != nullptr && slot->taken) slot = slot->next;
+    if (slot == nullptr) {
+        void *mem = mmap(0, pageAlign(sizeof(Counters)), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(mem != MAP_FAILED);
+        slot = new (mem) Counters;
+        slot->next = statsSlots;
+        statsSlots = slot;
+    }
+    slot->taken = true;
+    threadCounters = slot;
+    if (keyCreated) pthread_setspecific(statsKey, slot);
+    return *slot;
+}
+
+inline Counters &stats() {
+    if (threadCounters != nullptr) return *threadCounters;
+    return claimCounters();
+}
+
+
 /**
  * @brief First fit algorithm
  * Returns the first free block which fits the size
- traversal of all blocks starting at the beginning, of the heap (heapStart)
-  intialized on first allocation and returns first found block if it fits 
+ traversal of all blocks starting at the beginning of each arena, block
+  by block up to its epilogue, and returns first found block if it fits 
   the size or the nullptr otherwise.
  * @param size 
  * @return Block* 
@@ -139,55 +658,260 @@ Block *getHeader(word_t *data) {
 
 
 Block *firstFit(size_t size) {
-    Block * block = heapStart;
-    
-    while (block != nullptr) {
-        if (block->used || block->size < size) {
-            block = block->next;
-            continue;
+    uint64_t searched = 0;
+    for (Arena *a = heap->arena; a != nullptr; a = a->next) {
+        for (Block *block = firstBlock(a); !isEpilogue(block); block = nextBlock(block)) {
+            searched++;
+            if (isUsed(block) || getSize(block) < size) continue;
+            count(stats().blocksSearched, searched);
+            return block;
         }
-        return block;
     }
+    count(stats().blocksSearched, searched);
     return nullptr;
 };
 
 
-/* Mode for seasrching a free block */
-enum class SearchMode {
-    FirstFit, NextFit, BestFit, FreeList, SegregatedList,
-};
-
-/* Previously found block. Updated in nextFit */
-static Block *searchStart = heapStart;
-
 // current search mode.
 static auto searchMode = SearchMode::FirstFit;
 
+
+/* hooks keeping the free-block structure of the current search mode in
+sync with splitting and coalescing. defined with the search algorithms. */
+void insertFree(Block *block);
+void removeFree(Block *block);
+void trimUnlist(Block *block);
+void clearFree();
+void releaseRuns();
+void lockHeap();
+void unlockHeap();
+
+/* whether alloc/free go through the per-thread caches (see below) */
+static bool threadSafe = false;
+
+/* bumped on every reset, so thread caches can drop stale blocks */
+static std::atomic<unsigned> heapEpoch{0};
+
 /* Reset the heap to the original position. */
 void resetHeap() {
-    if (heapStart == nullptr) return; // heap is empty;
-    // roll back to the beginning
-    brk(heapStart);
-    heapStart = nullptr;
-    top = nullptr;
-    searchStart = nullptr;
+    releaseRuns();
+    heapEpoch++;
+    Heap *current = heap;
+    for (heap = heaps; heap < heaps + kMaxShards; ++heap) {
+        heap->remoteFrees = nullptr;
+        if (heap->arena == nullptr) continue; // heap is empty;
+        // roll back to the beginning
+        releaseArenas();
+        heap->searchStart = nullptr;
+        heap->deferredCount = 0;
+        clearFree();
+    }
+    heap = current;
 }
 
-void init(SearchMode mode) {
+void init(SearchMode mode, bool safe) {
+    if (safe) {
+        static bool forkSafe = pthread_atfork(lockHeap, unlockHeap, unlockHeap) == 0;
+        (void)forkSafe;
+    }
     searchMode = mode;
+    threadSafe = safe;
     resetHeap();
+    heap = &heaps[0];
+    shardCount = 1;
+    if (safe && arenaOwners == nullptr) {
+        void *owners = mmap(0, kOwnerEntries, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (owners != MAP_FAILED) arenaOwners = (uint8_t *)owners;
+    }
+    if (safe && arenaOwners != nullptr) {
+        int shards = heap_shards > 0 ? heap_shards : sysconf(_SC_NPROCESSORS_CONF);
+        shardCount = std::clamp(shards, 1, kMaxShards);
+    }
 }
 
-// Next-fit algorithm
-Block * nextFit(size_t size) {
-    // implement here
+
+
+// Implementation of Best-fit Search
+// free blocks are kept in a red-black tree ordered by (size, address),
+// so the smallest block that fits is found in O(log n) without walking
+// the heap. the tree is intrusive: its nodes live in the free payloads.
+
+/**
+ * @brief node of the best-fit tree, kept in the payload of a free block.
+ * the colour is stored in the low bit of the parent pointer.
+ */
+
+struct TreeNode {
+    Block *child[2];
+    uintptr_t parentColor;
 };
 
+inline Block **child(Block *block) {
+    return ((TreeNode *)block->data)->child;
+}
+
+inline Block *parentOf(Block *block) {
+    return (Block *)(((TreeNode *)block->data)->parentColor & ~(uintptr_t)1);
+}
 
+/* missing (leaf) nodes count as black */
+inline bool isRed(Block *block) {
+    return block && (((TreeNode *)block->data)->parentColor & 1);
+}
+
+inline void setParent(Block *block, Block *parent) {
+    auto &pc = ((TreeNode *)block->data)->parentColor;
+    pc = (uintptr_t)parent | (pc & 1);
+}
+
+inline void setRed(Block *block, bool red) {
+    auto &pc = ((TreeNode *)block->data)->parentColor;
+    pc = (pc & ~(uintptr_t)1) | (red ? 1 : 0);
+}
+
+/* blocks are ordered by size, equal sizes by address */
+inline bool treeLess(Block *a, Block *b) {
+    return getSize(a) < getSize(b) || (getSize(a) == getSize(b) && a < b);
+}
+
+/* puts 'to' in the place of 'from' under from's parent */
+void treeReplace(Block *from, Block *to) {
+    Block *parent = parentOf(from);
+    if (parent == nullptr) heap->treeRoot = to;
+    else child(parent)[from == child(parent)[1]] = to;
+    if (to != nullptr) setParent(to, parent);
+}
+
+/* rotates x down to the 'dir' side (0 = left), its other child moves up */
+void treeRotate(Block *x, int dir) {
+    Block *y = child(x)[!dir];
+    child(x)[!dir] = child(y)[dir];
+    if (child(y)[dir] != nullptr) setParent(child(y)[dir], x);
+    treeReplace(x, y);
+    child(y)[dir] = x;
+    setParent(x, y);
+}
+
+void treeInsert(Block *block) {
+    Block *parent = nullptr;
+    int dir = 0;
+    for (Block *x = heap->treeRoot; x != nullptr; x = child(x)[dir]) {
+        parent = x;
+        dir = treeLess(x, block);
+    }
+    child(block)[0] = child(block)[1] = nullptr;
+    ((TreeNode *)block->data)->parentColor = (uintptr_t)parent | 1;
+    if (parent == nullptr) heap->treeRoot = block;
+    else child(parent)[dir] = block;
+
+    // a red node may not have a red parent: recolour or rotate upwards
+    while (isRed(parentOf(block))) {
+        Block *p = parentOf(block);
+        Block *g = parentOf(p);
+        int side = p == child(g)[1];
+        Block *uncle = child(g)[!side];
+        if (isRed(uncle)) {
+            setRed(p, false);
+            setRed(uncle, false);
+            setRed(g, true);
+            block = g;
+            continue;
+        }
+        if (block == child(p)[!side]) {
+            block = p;
+            treeRotate(block, side);
+            p = parentOf(block);
+        }
+        setRed(p, false);
+        setRed(g, true);
+        treeRotate(g, !side);
+    }
+    setRed(heap->treeRoot, false);
+}
+
+/* restores the black height after a black node was taken out above x */
+void treeRemoveFixup(Block *x, Block *parent) {
+    while (x != heap->treeRoot && !isRed(x)) {
+        int side = x == child(parent)[1];
+        Block *sibling = child(parent)[!side];
+        if (isRed(sibling)) {
+            setRed(sibling, false);
+            setRed(parent, true);
+            treeRotate(parent, side);
+            sibling = child(parent)[!side];
+        }
+        if (!isRed(child(sibling)[0]) && !isRed(child(sibling)[1])) {
+            setRed(sibling, true);
+            x = parent;
+            parent = parentOf(x);
+            continue;
+        }
+        if (!isRed(child(sibling)[!side])) {
+            setRed(child(sibling)[side], false);
+            setRed(sibling, true);
+            treeRotate(sibling, !side);
+            sibling = child(parent)[!side];
+        }
+        setRed(sibling, isRed(parent));
+        setRed(parent, false);
+        setRed(child(sibling)[!side], false);
+        treeRotate(parent, side);
+        x = heap->treeRoot;
+    }
+    if (x != nullptr) setRed(x, false);
+}
+
+void treeRemove(Block *block) {
+    Block *x, *parent;
+    bool removedRed;
+    if (child(block)[0] == nullptr || child(block)[1] == nullptr) {
+        x = child(block)[0] ? child(block)[0] : child(block)[1];
+        parent = parentOf(block);
+        removedRed = isRed(block);
+        treeReplace(block, x);
+    } else {
+        // the in-order successor takes the place of the removed block
+        Block *next = child(block)[1];
+        while (child(next)[0] != nullptr) next = child(next)[0];
+        removedRed = isRed(next);
+        x = child(next)[1];
+        if (parentOf(next) == block) {
+            parent = next;
+        } else {
+            parent = parentOf(next);
+            treeReplace(next, x);
+            child(next)[1] = child(block)[1];
+            setParent(child(next)[1], next);
+        }
+        treeReplace(block, next);
+        child(next)[0] = child(block)[0];
+        setParent(child(next)[0], next);
+        setRed(next, isRed(block));
+    }
+    if (!removedRed) treeRemoveFixup(x, parent);
+}
+
+/**
+ * @brief Best fit algorithm
+ * takes the smallest free block that fits the size (the lowest address
+ among equal sizes) out of the tree in O(log n).
+ */
 
-// Implementation of Best-fit Search
 Block *bestFit(size_t size) {
-    // implementation
+    Block *best = nullptr;
+    uint64_t searched = 0;
+    for (Block *x = heap->treeRoot; x != nullptr; searched++) {
+        if (getSize(x) >= size) {
+            best = x;
+            x = child(x)[0];
+        } else {
+            x = child(x)[1];
+        }
+    }
+    count(stats().blocksSearched, searched);
+    if (best != nullptr) treeRemove(best);
+    return best;
 };
 
 
@@ -204,20 +928,50 @@ Block *bestFit(size_t size) {
 
 // ----------------------------------------------------------------
 
+/**
+ * @brief splits the block into one of exactly 'size' bytes and a free
+ remainder right after it. the remainder goes into the free list so it
+ can serve later requests.
+ */
+
 Block *split(Block *block, size_t size) {
-    // to be implemented
+    Block *rest = (Block *)((char *)block + allocSize(size));
+    setHeader(rest, (getSize(block) - allocSize(size)) | (isUsed(block) ? kPrevUsed : 0));
+    markUsed(rest, false);
+
+    setSize(block, size);
+    insertFree(rest);
+    count(stats().splits);
+    return block;
 };
 
+/* payload size as the heap hands it out: with the header the block has
+   to span a multiple of kMinAlign, so every payload stays aligned */
+inline size_t payloadSize(size_t size) {
+    return alignUp(size + sizeof(word_t), kMinAlign) - sizeof(word_t);
+}
+
+/* smallest payload a block can have in the current search mode. a free
+   block keeps its footer in the payload, and on the intrusive lists and
+   in the best-fit tree its links as well. */
+inline size_t minPayload() {
+    if (searchMode == SearchMode::SegregatedList || searchMode == SearchMode::NextFit ||
+        searchMode == SearchMode::Bitmap) return payloadSize(2 * sizeof(Block *) + sizeof(word_t));
+    if (searchMode == SearchMode::BestFit) return payloadSize(sizeof(TreeNode) + sizeof(word_t));
+    return payloadSize(sizeof(word_t));
+}
+
+/* the remainder must fit its own header and a minimal payload */
 inline bool canSplit(Block *block, size_t size) {
-    // implement here
+    return getSize(block) >= size + allocSize(minPayload());
 }
 
 Block *listAllocate(Block *block, size_t size) {
+    trimUnlist(block);
     if (canSplit(block, size)) {
         block = split(block, size);
     }
-    block->used = true;
-    block->size = size;
+    markUsed(block, true);
     return block;
 }
 
@@ -227,40 +981,53 @@ on freeing the blocks, we can do the opposite to splitting
 operationg and coalesce two or more adjacent blocks to
 a larger one. */
 
-// merging procedure
+// merging procedure -- thanks to the boundary tags both neighbours
+// are found in O(1).
 bool canCoalesce(Block* block) {
-    return block->next && !block->next->used;
+    return !isPrevUsed(block) || !isUsed(nextBlock(block));
 }
 
-Block *coalesce(Block *block) {
-    // ... implement here
-};
+/**
+ * @brief merges the free block with its free neighbours on both sides.
+ * returns the header of the merged block, which is the left neighbour
+ when that one was free.
+ */
 
+Block *coalesce(Block *block) {
+    Block *next = nextBlock(block);
+    if (!isUsed(next)) {
+        removeFree(next);
+        setSize(block, getSize(block) + allocSize(getSize(next)));
+        count(stats().coalesces);
+    }
 
-/* Frees the previously allocated block ... */
-void free(word_t *data) {
-    Block* block = getHeader(data);
-    if (canCoalesce(block)) {
-        block = coalesce(block);
+    if (Block *prev = prevBlock(block)) {
+        removeFree(prev);
+        setSize(prev, getSize(prev) + allocSize(getSize(block)));
+        block = prev;
+        count(stats().coalesces);
     }
-    block->used = false;
-}
+
+    setFooter(block);
+    return block;
+};
 
 
 // ----------------------------------------------------------------
 
 // Concept of an Explicit Free-List
 
-#include <list>
-
-static std::list<Block *> free_list;
-
 Block *freeList(size_t size) {
-    for (const auto& block: free_list) {
-        if (block->size < size) continue;
-        free_list.remove(block);
-        return listAllocate(block, size);
+    uint64_t searched = 0;
+    for (auto it = freeList().begin(); it != freeList().end(); ++it) {
+        Block *block = *it;
+        searched++;
+        if (getSize(block) < size) continue;
+        freeList().erase(it);
+        count(stats().blocksSearched, searched);
+        return block;
     }
+    count(stats().blocksSearched, searched);
     return nullptr;
 }
 
@@ -272,85 +1039,410 @@ Block *freeList(size_t size) {
 -- where instead of having one list of blocks, we have many lists of blocks
 but each list contains only blocks of a certain size. */
 
-Block *segregatedLists[] = {
-    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+/**
+ * @brief links of a free block on a segregated list, kept in its payload.
+ */
+
+struct FreeLinks {
+    Block *prev;
+    Block *next;
 };
 
+inline FreeLinks *getLinks(Block *block) {
+    return (FreeLinks *)block->data;
+}
+
 inline int getBucket(size_t size) {
-    return size / sizeof(word_t) - 1;
+    if (size < kSmallLimit) return size / sizeof(word_t) - 1;
+    int fl = 63 - __builtin_clzll(size);
+    int sl = (size >> (fl - 2)) & (kClassSteps - 1);
+    return kSmallClasses + (fl - kSmallShift) * kClassSteps + sl;
 };
 
-Block *segregatedFit(size_t size) {
-    auto bucket = getBucket(size);
-    auto originalHeapStart = heapStart;
+/* pushes the free block on the list of its class */
+void segregatedInsert(Block *block) {
+    int bucket = getBucket(getSize(block));
+    Block *head = heap->segregatedLists[bucket];
+    getLinks(block)->prev = nullptr;
+    getLinks(block)->next = head;
+    if (head != nullptr) getLinks(head)->prev = block;
+    heap->segregatedLists[bucket] = block;
+    heap->segregatedMap[bucket / 64] |= 1ULL << (bucket % 64);
+}
 
-    heapStart = segregatedLists[bucket];
-    Block* block = firstFit(size);
+/* unlinks the free block from the list of its class */
+void segregatedRemove(Block *block) {
+    int bucket = getBucket(getSize(block));
+    FreeLinks *links = getLinks(block);
+    if (links->prev != nullptr) getLinks(links->prev)->next = links->next;
+    else heap->segregatedLists[bucket] = links->next;
+    if (links->next != nullptr) getLinks(links->next)->prev = links->prev;
+    if (heap->segregatedLists[bucket] == nullptr) {
+        heap->segregatedMap[bucket / 64] &= ~(1ULL << (bucket % 64));
+    }
+}
 
-    heapStart = originalHeapStart;
+/* first non-empty class at or above the bucket, -1 if there is none */
+inline int nextBucket(int bucket) {
+    for (int i = bucket / 64; i < (kNumClasses + 63) / 64; ++i) {
+        uint64_t bits = heap->segregatedMap[i];
+        if (i == bucket / 64) bits &= ~0ULL << (bucket % 64);
+        if (bits) return i * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+/**
+ * @brief takes a free block from the smallest class that fits the size.
+ * a small class holds blocks of exactly one size. a large class may
+ hold blocks smaller than the request, so only its head is tried and
+ otherwise any block of the next non-empty class fits.
+ */
+
+Block *segregatedFit(size_t size) {
+    int bucket = getBucket(size);
+    Block *block = heap->segregatedLists[bucket];
+    count(stats().blocksSearched, block != nullptr);
+
+    if (block == nullptr || getSize(block) < size) {
+        bucket = nextBucket(bucket + 1);
+        if (bucket < 0) return nullptr;
+        block = heap->segregatedLists[bucket];
+        count(stats().blocksSearched);
+    }
+    segregatedRemove(block);
     return block;
 };
 
-
 // ----------------------------------------------------------------
 
-// Optimization of storage
-typedef struct {
-    size_t header;
-    word_t data[1];
-} to_opt_block;
+/* Next fit -- one free list in address order, searched from where the
+last search stopped (the roving pointer) and wrapping around at its end.
+consecutive allocations do not scan the same small blocks at the front
+of the heap over and over like first fit does.
+
+a block taken out of the list leaves a hint: its successor. split
+remainders and merged blocks go back right before it, so keeping the
+order costs nothing on the common paths, and when the block taken out
+was the rover's they take over the rover too. */
+
+/* free blocks looked at in memory before the list is walked from its head */
+constexpr int kNeighbourScan = 16;
+
+/* the free block the block goes before, nullptr for the end of the list */
+Block *addressSuccessor(Block *block) {
+    if (heap->hintSet) {
+        Block *prev = heap->insertHint ? getLinks(heap->insertHint)->prev : heap->addressTail;
+        if ((heap->insertHint == nullptr || heap->insertHint > block) && (prev == nullptr || prev < block))
+            return heap->insertHint;
+    }
+    // the next free block of the arena usually follows soon after
+    Block *next = nextBlock(block);
+    for (int i = 0; i < kNeighbourScan && !isEpilogue(next); ++i, next = nextBlock(next)) {
+        if (!isUsed(next)) return next;
+    }
+    Block *succ = heap->addressHead;
+    while (succ != nullptr && succ < block) succ = getLinks(succ)->next;
+    return succ;
+}
 
-/* returns actual size */
-inline size_t getSize(to_opt_block *block) {
-    return block->header & ~1L;
+void addressInsert(Block *block) {
+    Block *next = addressSuccessor(block);
+    Block *prev = next ? getLinks(next)->prev : heap->addressTail;
+    getLinks(block)->prev = prev;
+    getLinks(block)->next = next;
+    if (prev != nullptr) getLinks(prev)->next = block;
+    else heap->addressHead = block;
+    if (next != nullptr) getLinks(next)->prev = block;
+    else heap->addressTail = block;
+    if (heap->hintSet && next == heap->insertHint && next == heap->searchStart) heap->searchStart = block;
+}
+
+/* unlinks the block, the roving pointer moves on to its successor */
+void addressRemove(Block *block) {
+    FreeLinks *links = getLinks(block);
+    if (links->prev != nullptr) getLinks(links->prev)->next = links->next;
+    else heap->addressHead = links->next;
+    if (links->next != nullptr) getLinks(links->next)->prev = links->prev;
+    else heap->addressTail = links->prev;
+
+    if (heap->searchStart == block) heap->searchStart = links->next;
+    heap->insertHint = links->next;
+    heap->hintSet = true;
+}
+
+/**
+ * @brief Next fit algorithm
+ * walks the address-ordered free list from the roving pointer, wraps to
+ the head at the end and gives up once it is back where it started.
+ */
+
+Block *nextFit(size_t size) {
+    uint64_t searched = 0;
+    Block *start = heap->searchStart ? heap->searchStart : heap->addressHead;
+    for (Block *block = start; block != nullptr;) {
+        searched++;
+        if (getSize(block) >= size) {
+            count(stats().blocksSearched, searched);
+            heap->searchStart = block;
+            addressRemove(block);
+            return block;
+        }
+        block = getLinks(block)->next ? getLinks(block)->next : heap->addressHead;
+        if (block == start) break;
+    }
+    count(stats().blocksSearched, searched);
+    return nullptr;
 };
 
-/* check if the block is being used */
-inline bool isUsed(to_opt_block *block) {
-    return block->header & 1;
+// ----------------------------------------------------------------
+
+/* Bitmap runs -- small objects do not need a header each. in Bitmap mode
+every small size gets page-sized runs of equal slots, and each run keeps
+one bit per slot in a 64-byte bitmap (512 slots for 8-byte objects) plus
+a byte telling which bitmap words still have a free slot. finding a free
+slot is two ctz instructions instead of chasing Block::next pointers
+through scattered headers. larger requests use the segregated lists.
+
+the run metadata lives outside the runs, in an array indexed by the run
+number, so a run is pure payload and free() recognises a slot by its
+address falling into the reserved run region. */
+
+constexpr size_t kRunSize = 4096;
+constexpr size_t kRunRegion = (size_t)1 << 30;  // reserved for runs
+constexpr size_t kMaxRuns = kRunRegion / kRunSize;
+
+struct alignas(64) Run {
+    uint64_t bits[8];       // 1 = free slot
+    Run *prev, *next;       // runs of the class with free slots
+    Heap *owner;
+    uint32_t slotSize;
+    uint16_t slots, freeSlots;
+    uint8_t summary;        // bitmap words that have a free slot
+    bool trimmed;           // empty, and its page went back to the OS
+};
+
+// read without a lock by free(), set once per heap. the region is
+// shared by the shards, each run belongs to the one that carved it.
+static std::atomic<char *> runBase{nullptr};
+static Run *runMeta = nullptr;
+static size_t runCount = 0;                     // runs carved so far
+static std::mutex runLock;                      // guards carving
+
+inline bool isSlot(word_t *data) {
+    char *base = runBase.load(std::memory_order_relaxed);
+    return base != nullptr && (size_t)((char *)data - base) < kRunRegion;
 }
 
-/* sets the used flag */
-inline void setUsed(to_opt_block *block, bool used) {
-    if (used) block->header |= 1;
-    else block->header &= ~1;
+inline Run *getRun(word_t *data) {
+    return &runMeta[((char *)data - runBase.load(std::memory_order_relaxed)) / kRunSize];
 }
 
-// ----------------------------------------------------------------
+inline char *runStart(Run *run) {
+    return runBase.load(std::memory_order_relaxed) + (run - runMeta) * kRunSize;
+}
 
-// Implementation of a custom sbrk - mapping of external files
-// memory is requested. mmap can be used for both, mapping 
-// used to create anonymous mappings (not backed by any file)
+inline void linkRun(Run *run) {
+    Run *&head = heap->partialRuns[run->slotSize / sizeof(word_t) - 1];
+    run->prev = nullptr;
+    run->next = head;
+    if (head != nullptr) head->prev = run;
+    head = run;
+}
 
-#include <sys/mman.h>
+inline void unlinkRun(Run *run) {
+    Run *&head = heap->partialRuns[run->slotSize / sizeof(word_t) - 1];
+    if (run->prev != nullptr) run->prev->next = run->next;
+    else head = run->next;
+    if (run->next != nullptr) run->next->prev = run->prev;
+}
 
-/**
- * @brief allocation arena for custom sbrk example
- */
+/* hands out a run of 'size' slots, reusing an empty one if possible */
+Run *newRun(size_t size) {
+    Run *run = heap->emptyRuns;
+    if (run != nullptr) {
+        heap->emptyRuns = run->next;
+    } else {
+        std::lock_guard<std::mutex> guard(runLock);
+        if (runBase == nullptr) {
+            // reserve address space only, pages are backed once touched
+            void *region = mmap(0, kRunRegion, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            void *meta = mmap(0, kMaxRuns * sizeof(Run), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (region == MAP_FAILED || meta == MAP_FAILED) return nullptr;
+            runMeta = (Run *)meta;
+            runBase = (char *)region;
+        }
+        if (runCount == kMaxRuns) return nullptr;
+        run = &runMeta[runCount++];
+        mapped_bytes += kRunSize;
+        heap_bytes += kRunSize;
+    }
+    run->owner = heap;
+    run->trimmed = false;
+
+    run->slotSize = size;
+    run->slots = run->freeSlots = kRunSize / size;
+    run->summary = 0;
+    for (int word = 0; word < 8; ++word) {
+        int first = word * 64;
+        int n = run->slots > first ? run->slots - first : 0;
+        run->bits[word] = n >= 64 ? ~0ULL : (1ULL << n) - 1;
+        if (n > 0) run->summary |= 1 << word;
+    }
+    linkRun(run);
+    return run;
+}
 
- // static void *arena = nullptr;
- static char *_brk = nullptr;
- static size_t arena_size = 4193404;
+word_t *bitmapAlloc(size_t size) {
+    Run *run = heap->partialRuns[size / sizeof(word_t) - 1];
+    if (run == nullptr && (run = newRun(size)) == nullptr) return nullptr;
 
- // map a large chunk of anonymous memory
- // virtual heap for custom sbrk manipulation
- static void *arena = mmap(0, arena_size, PROT_READ | 
-                            PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int word = __builtin_ctz(run->summary);
+    int bit = __builtin_ctzll(run->bits[word]);
+    run->bits[word] &= run->bits[word] - 1;
+    if (run->bits[word] == 0) run->summary &= ~(1 << word);
+    if (--run->freeSlots == 0) unlinkRun(run);
 
-// implement our own
-void *_sbrk(intptr_t increment) {
-    // to be implemented
+    return (word_t *)(runStart(run) + (word * 64 + bit) * run->slotSize);
+}
 
-    // 0. pre allocate large arena using `mmap` init program break to 
-    // the beginning of this arena.
+/* frees a slot. a run with nothing in use goes back to the empty runs,
+   unless it is the last run of its class with free slots. */
+void bitmapFree(word_t *data) {
+    Run *run = getRun(data);
+    size_t slot = ((char *)data - runStart(run)) / run->slotSize;
+
+    if (run->freeSlots++ == 0) linkRun(run);
+    run->bits[slot / 64] |= 1ULL << (slot % 64);
+    run->summary |= 1 << (slot / 64);
+
+    if (run->freeSlots == run->slots && (run->prev || run->next)) {
+        unlinkRun(run);
+        run->next = heap->emptyRuns;
+        heap->emptyRuns = run;
+        heap->freedSinceTrim += kRunSize;
+    }
+}
 
-    // 1. if increment is 0, return current break position
+void releaseRuns() {
+    if (runBase == nullptr) return;
+    munmap(runBase.load(), kRunRegion);
+    munmap(runMeta, kMaxRuns * sizeof(Run));
+    mapped_bytes -= runCount * kRunSize;
+    heap_bytes -= runCount * kRunSize;
+    runBase = nullptr;
+    runMeta = nullptr;
+    runCount = 0;
+    for (int i = 0; i < kMaxShards; ++i) {
+        heaps[i].emptyRuns = nullptr;
+        for (auto &head : heaps[i].partialRuns) head = nullptr;
+    }
+}
 
-    // 2. if current + increment exceeds top of arena, return -1
+/* usable bytes of an allocation */
+size_t usableSize(word_t *data) {
+    if (isSlot(data)) return getRun(data)->slotSize;
+    return getSize(getHeader(data));
+}
 
-    // 3. otherwise, increase the program break on increment bytes
+/* bytes an allocation takes from the heap, headers included */
+inline size_t footprint(word_t *data) {
+    if (isSlot(data)) return getRun(data)->slotSize;
+    return allocSize(getSize(getHeader(data)));
+}
+
+// ----------------------------------------------------------------
+
+// Trim list -- a trim only looks at the free blocks large enough to give
+// pages back. they are linked behind the links of the search modes, so
+// every mode keeps the list, and a trim empties it: a block only comes
+// back once it was merged or split.
+
+struct TrimLinks {
+    Block *prev;
+    Block *next;
 };
 
+inline TrimLinks *getTrimLinks(Block *block) {
+    return (TrimLinks *)((char *)block->data + sizeof(TreeNode));
+}
+
+void trimList(Block *block) {
+    if (getSize(block) < std::max(trim_threshold, sizeof(TreeNode) + sizeof(TrimLinks) + sizeof(word_t)))
+        return;
+    getTrimLinks(block)->prev = nullptr;
+    getTrimLinks(block)->next = heap->trimHead;
+    if (heap->trimHead != nullptr) getTrimLinks(heap->trimHead)->prev = block;
+    heap->trimHead = block;
+    setHeader(block, getHeaderWord(block) | kTrimListed);
+}
+
+void trimUnlist(Block *block) {
+    if (!(getHeaderWord(block) & kTrimListed)) return;
+    TrimLinks *links = getTrimLinks(block);
+    if (links->prev != nullptr) getTrimLinks(links->prev)->next = links->next;
+    else heap->trimHead = links->next;
+    if (links->next != nullptr) getTrimLinks(links->next)->prev = links->prev;
+    setHeader(block, getHeaderWord(block) & ~kTrimListed);
+}
+
+// ----------------------------------------------------------------
+
+void insertFree(Block *block) {
+    trimList(block);
+    switch (searchMode) {
+        case SearchMode::NextFit:
+            addressInsert(block);
+            break;
+        case SearchMode::FreeList:
+            freeList().push_back(block);
+            break;
+        case SearchMode::SegregatedList:
+        case SearchMode::Bitmap:
+            segregatedInsert(block);
+            break;
+        case SearchMode::BestFit:
+            treeInsert(block);
+            break;
+        default:
+            break;
+    }
+}
+
+void removeFree(Block *block) {
+    trimUnlist(block);
+    switch (searchMode) {
+        case SearchMode::NextFit:
+            addressRemove(block);
+            break;
+        case SearchMode::FreeList:
+            freeList().remove(block);
+            break;
+        case SearchMode::SegregatedList:
+        case SearchMode::Bitmap:
+            segregatedRemove(block);
+            break;
+        case SearchMode::BestFit:
+            treeRemove(block);
+            break;
+        default:
+            break;
+    }
+}
+
+void clearFree() {
+    heap->addressHead = heap->addressTail = heap->insertHint = nullptr;
+    heap->hintSet = false;
+    freeList().clear();
+    for (auto &head : heap->segregatedLists) head = nullptr;
+    for (auto &bits : heap->segregatedMap) bits = 0;
+    heap->treeRoot = nullptr;
+    heap->trimHead = nullptr;
+}
+
+
 // ----------------------------------------------------------------
 
 /**
@@ -362,6 +1454,7 @@ void *_sbrk(intptr_t increment) {
 
 
 Block* findBlock(size_t size) {
+    count(stats().searches);
     switch(searchMode) {
         case SearchMode::FirstFit:          // general purpose search algorithm
             return firstFit(size);
@@ -372,8 +1465,10 @@ Block* findBlock(size_t size) {
         case SearchMode::FreeList:          // optimizing search speed by linking only free blocks
             return freeList(size);
         case SearchMode::SegregatedList:
+        case SearchMode::Bitmap:            // larger requests of bitmap mode
             return segregatedFit(size);     // optimizing search speed by size of blocks
     }
+    return nullptr;
 };
 
 
@@ -384,55 +1479,1162 @@ Block* findBlock(size_t size) {
  for the return type.
  */
 
-// Allocates a block of memory of (at least) 'size' bytes.
-word_t *alloc(size_t size) {
-    size = align(size);
+// Allocates a block of memory of 'size' bytes, already aligned.
+// 'fresh' tells whether the block comes straight from the OS (still zero).
+word_t *blockAlloc(size_t size, bool *fresh = nullptr);
+
+/* frees the blocks waiting in the deferred-free buffer, see below */
+bool drainFrees();
+
+word_t *heapAlloc(size_t size, bool *fresh = nullptr) {
+    // small objects of bitmap mode come from the runs
+    if (searchMode == SearchMode::Bitmap && size <= kBitmapLimit) {
+        if (word_t *data = bitmapAlloc(size)) return data;
+    }
+    return blockAlloc(size, fresh);
+}
+
+/* allocates from the heap blocks, never from the bitmap runs */
+word_t *blockAlloc(size_t size, bool *fresh) {
+    size = std::max(payloadSize(size), minPayload());
 
     // ------------------------------------------------------------
     // 1. Search for available free block.
 
     if (Block* block = findBlock(size)) {
-        return block->data;
+        return listAllocate(block, size)->data;
+    }
+    // blocks still waiting to be freed may cover the request
+    if (drainFrees()) {
+        if (Block *block = findBlock(size)) return listAllocate(block, size)->data;
     }
     // ------------------------------------------------------------
     // 2. If block is not found in the free list, request from OS.
 
     Block * block = requestFromOS(size);
-    
-    block->size = size;
-    block->used = true;
-
-
-    // initialize heap;
-    if (heapStart == nullptr) heapStart = block;
-
-    // chain the blocks
-    if (top != nullptr) top->next = block;
-
-    top = block;
+    if (block == nullptr) return nullptr;
+    if (fresh != nullptr) *fresh = true;
 
     // user payload
     return block->data;
 };
 
+/**
+ * @brief gives the whole pages of a large free block back to the OS.
+ header, free-block links and footer stay in place, the released pages
+ read as zero when they are touched again. on a huge-page arena only
+ whole 2 MiB pages go, anything less would split them.
+ */
+
+void releasePages(Block *block, size_t page) {
+    uintptr_t from = alignUp((uintptr_t)block->data + sizeof(TreeNode), page);
+    uintptr_t to = (uintptr_t)getFooter(block) & ~(page - 1);
+    if (from < to) madvise((void *)from, to - from, MADV_DONTNEED);
+}
+
+/* releases the pages of the large free blocks and the empty runs that
+   came since the last trim. with huge-page arenas in the heap only whole
+   2 MiB pages go, in its other arenas too. */
+void trimHeap() {
+    size_t page = heap->hugeArenas ? kHugePage : pageSize();
+    for (Block *block = heap->trimHead, *next; block != nullptr; block = next) {
+        next = getTrimLinks(block)->next;
+        setHeader(block, getHeaderWord(block) & ~kTrimListed);
+        releasePages(block, page);
+    }
+    heap->trimHead = nullptr;
+    // runs are emptied and reused at the head of the list, so the ones
+    // trimmed before are all behind the first of them
+    for (Run *run = heap->emptyRuns; run != nullptr && !run->trimmed; run = run->next) {
+        madvise(runStart(run), kRunSize, MADV_DONTNEED);
+        run->trimmed = true;
+    }
+    heap->freedSinceTrim = 0;
+}
+
 /**
  * @brief sets the used flag to false
     * receives actual user pointer from which it finds the block
     * with header function and then updates the used flag
+    * the block is merged with free neighbours before it is handed back
  * 
  * @param data 
  */
 
 
-void free(word_t *data) {
+void deferFree(word_t *data);
+
+/* merges the used block with its free neighbours and hands it back */
+void releaseBlock(Block *block) {
+    setUsed(block, false);
+    heap->hintSet = false;    // only a neighbour merged below leaves a hint
+
+    if (canCoalesce(block)) {
+        block = coalesce(block);
+    }
+    markUsed(block, false);
+    insertFree(block);
+}
+
+/* trimming on every free would fault the same pages back in as soon as
+   the block is split again, so trim once half the heap was freed. */
+inline void checkTrim() {
+    if (heap->freedSinceTrim >= std::max(trim_threshold, heap->bytes / 2)) trimHeap();
+}
+
+void heapFree(word_t *data) {
+    if (isSlot(data)) {
+        bitmapFree(data);
+        return checkTrim();
+    }
+    if (defer_frees) return deferFree(data);
+
     Block* block = getHeader(data);
-    block->used = false;
+    heap->freedSinceTrim += allocSize(getSize(block));
+    releaseBlock(block);
+    checkTrim();
+};
+
+// ----------------------------------------------------------------
+
+// Deferred frees -- with defer_frees on, a free only parks the block in
+// a buffer and the block stays 'used' for the heap. the buffer is drained
+// when it fills up or when an allocation finds no free block: sorted by
+// address, blocks lying next to each other are joined into one run first,
+// so a whole run is merged with its neighbours and inserted once instead
+// of block by block. tearing down a large object graph then costs a
+// store per free.
+
+void deferFree(word_t *data) {
+    heap->deferred[heap->deferredCount++] = data;
+    if (heap->deferredCount == kDeferMax) drainFrees();
+}
+
+/* frees every parked block, returns false if there were none */
+bool drainFrees() {
+    if (heap->deferredCount == 0) return false;
+    std::sort(heap->deferred, heap->deferred + heap->deferredCount);
+
+    for (int i = 0; i < heap->deferredCount;) {
+        Block *run = getHeader(heap->deferred[i++]);
+        heap->freedSinceTrim += allocSize(getSize(run));
+        // parked blocks right after it join the run while still 'used'
+        while (i < heap->deferredCount && getHeader(heap->deferred[i]) == nextBlock(run)) {
+            size_t size = allocSize(getSize(getHeader(heap->deferred[i++])));
+            setSize(run, getSize(run) + size);
+            heap->freedSinceTrim += size;
+            count(stats().coalesces);
+        }
+        releaseBlock(run);
+    }
+    heap->deferredCount = 0;
+    checkTrim();
+    return true;
+}
+
+
+// ----------------------------------------------------------------
+
+// Shards -- one locked heap shared by all threads serializes them on its
+// lock. a thread-safe heap is split into shards instead, one per CPU,
+// each with its own arenas, free structures and lock. a thread allocates
+// from the shard of the CPU it runs on, so threads on different CPUs
+// rarely meet. a block always goes back to the shard that owns it: freed
+// from another shard it is pushed onto the owner's remote-free list
+// without taking a lock, and the owner frees the list the next time it
+// takes its own lock.
+
+#include <sched.h>
+
+/* the shard of the CPU the thread runs on, or one assigned round-robin
+   when the CPU is unknown */
+Heap *localHeap() {
+    if (shardCount == 1) return &heaps[0];
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        static std::atomic<unsigned> nextShard{0};
+        static thread_local unsigned assigned = nextShard++;
+        cpu = assigned;
+    }
+    return &heaps[cpu % shardCount];
+}
+
+/* the shard owning a block of an arena or a run slot */
+Heap *ownerOf(word_t *data) {
+    if (shardCount == 1) return &heaps[0];
+    if (isSlot(data)) return getRun(data)->owner;
+    uint8_t shard = __atomic_load_n(&arenaOwners[(uintptr_t)data >> kOwnerShift], __ATOMIC_RELAXED);
+    return &heaps[shard];
+}
+
+/* hands a block to its owner, never blocks: a lock-free stack the owner
+   takes whole, so the pushes cannot run into ABA */
+void remoteFree(Heap *owner, word_t *data) {
+    word_t *head = owner->remoteFrees.load(std::memory_order_relaxed);
+    do {
+        *data = (word_t)head;
+    } while (!owner->remoteFrees.compare_exchange_weak(head, data, std::memory_order_release,
+                                                       std::memory_order_relaxed));
+}
+
+/* frees the blocks other shards handed back, under the shard's lock */
+void drainRemote() {
+    if (heap->remoteFrees.load(std::memory_order_relaxed) == nullptr) return;
+    word_t *data = heap->remoteFrees.exchange(nullptr, std::memory_order_acquire);
+    while (data != nullptr) {
+        word_t *next = (word_t *)*data;
+        heapFree(data);
+        data = next;
+    }
+}
+
+/**
+ * @brief holds a shard for the scope: takes its lock in thread-safe mode
+ and points 'heap' at it, so the heap functions work on that shard.
+ */
+
+struct HeapGuard {
+    explicit HeapGuard(Heap *shard) : saved(heap) {
+        if (threadSafe) shard->lock.lock();
+        heap = shard;
+        drainRemote();
+    }
+    HeapGuard(const HeapGuard &) = delete;
+    HeapGuard &operator=(const HeapGuard &) = delete;
+    ~HeapGuard() {
+        if (threadSafe) heap->lock.unlock();
+        heap = saved;
+    }
+
+    Heap *saved;
+};
+
+/* frees a block of any shard, from the thread's own shard */
+void shardFree(word_t *data) {
+    Heap *owner = ownerOf(data);
+    if (owner != localHeap()) return remoteFree(owner, data);
+    HeapGuard guard(owner);
+    heapFree(data);
+}
+
+/* fork() from a thread-safe heap: the forking thread takes the locks, so
+   the child does not inherit a lock some other thread held mid-update */
+void lockHeap() {
+    for (Heap &shard : heaps) shard.lock.lock();
+    runLock.lock();
+    statsLock.lock();
+}
+
+void unlockHeap() {
+    statsLock.unlock();
+    runLock.unlock();
+    for (Heap &shard : heaps) shard.lock.unlock();
+}
+
+// Thread caches -- in front of the shards every thread keeps small bins
+// of recently freed blocks, so a free followed by an alloc of the same
+// size never touches a lock. cached blocks stay 'used' for the heap; bins
+// that overflow are handed back to their shards in one batch.
+
+constexpr int kCacheBins = 32;                  // sizes up to 256 bytes
+constexpr int kCacheMax = 64;                   // blocks kept per bin
+constexpr int kCacheRefill = 8;                 // blocks taken on a miss
+
+struct ThreadCache {
+    /* cached payloads of each size, chained through their first word */
+    word_t *bins[kCacheBins] = {};
+    int counts[kCacheBins] = {};
+    unsigned epoch = 0;
+
+    ~ThreadCache();
+};
+
+static thread_local ThreadCache threadCache;
+
+inline int cacheBin(size_t size) {
+    return size / sizeof(word_t) - 1;
+}
+
+/* hands the first 'n' blocks of the bin back to the shards owning them */
+void flushCache(ThreadCache &cache, int bin, int n) {
+    HeapGuard guard(localHeap());
+    for (; n > 0 && cache.bins[bin] != nullptr; --n) {
+        word_t *data = cache.bins[bin];
+        cache.bins[bin] = (word_t *)*data;
+        cache.counts[bin]--;
+        Heap *owner = ownerOf(data);
+        if (owner == heap) heapFree(data);
+        else remoteFree(owner, data);
+    }
+}
+
+/* blocks of a heap that was reset since they were cached are gone */
+inline void checkEpoch(ThreadCache &cache) {
+    unsigned epoch = heapEpoch.load(std::memory_order_relaxed);
+    if (cache.epoch == epoch) return;
+    for (int bin = 0; bin < kCacheBins; ++bin) {
+        cache.bins[bin] = nullptr;
+        cache.counts[bin] = 0;
+    }
+    cache.epoch = epoch;
+}
+
+ThreadCache::~ThreadCache() {
+    checkEpoch(*this);
+    for (int bin = 0; bin < kCacheBins; ++bin) flushCache(*this, bin, counts[bin]);
+}
+
+word_t *cacheAlloc(size_t size, bool *fresh = nullptr) {
+    ThreadCache &cache = threadCache;
+    checkEpoch(cache);
+    int bin = cacheBin(size);
+
+    if (bin < kCacheBins) {
+        if (word_t *data = cache.bins[bin]) {
+            cache.bins[bin] = (word_t *)*data;
+            cache.counts[bin]--;
+            count(stats().cacheHits);
+            return data;
+        }
+        // refill the empty bin with a few blocks under a single lock
+        HeapGuard guard(localHeap());
+        word_t *data = heapAlloc(size, fresh);
+        for (int i = 1; data != nullptr && i < kCacheRefill; ++i) {
+            word_t *extra = heapAlloc(size);
+            if (extra == nullptr) break;
+            *extra = (word_t)cache.bins[bin];
+            cache.bins[bin] = extra;
+            cache.counts[bin]++;
+        }
+        return data;
+    }
+    HeapGuard guard(localHeap());
+    return heapAlloc(size, fresh);
+}
+
+void cacheFree(word_t *data) {
+    ThreadCache &cache = threadCache;
+    checkEpoch(cache);
+    int bin = cacheBin(usableSize(data));
+
+    if (bin < kCacheBins) {
+        *data = (word_t)cache.bins[bin];
+        cache.bins[bin] = data;
+        if (++cache.counts[bin] > kCacheMax) flushCache(cache, bin, kCacheMax / 2);
+        return;
+    }
+    shardFree(data);
+}
+
+// ----------------------------------------------------------------
+
+/* request size as the heap hands it out. bitmap slots keep no footer
+   or links, so small sizes need no minimum there. */
+inline size_t blockSize(size_t size) {
+    if (searchMode == SearchMode::Bitmap && size <= kBitmapLimit)
+        return alignUp(std::max<size_t>(size, 1), kMinAlign);
+    size = payloadSize(size);
+    return size < minPayload() ? minPayload() : size;
+}
+
+inline void countAlloc(word_t *data, size_t requested) {
+    Counters &counters = stats();
+    count(counters.allocs);
+    count(counters.requestedBytes, requested);
+    count(counters.allocatedBytes, footprint(data));
+    count(counters.allocsBySize[sizeBin(usableSize(data))]);
+}
+
+inline void countFree(word_t *data) {
+    Counters &counters = stats();
+    count(counters.frees);
+    count(counters.freedBytes, footprint(data));
+    count(counters.freesBySize[sizeBin(usableSize(data))]);
+}
+
+word_t *allocate(size_t requested, bool *fresh) {
+    if (requested > kMaxRequest) return nullptr;
+    size_t size = blockSize(requested);
+
+    word_t *data;
+    if (size >= mmap_threshold) {
+        data = mapLarge(size);
+        if (fresh != nullptr) *fresh = true;
+    }
+    else if (threadSafe) data = cacheAlloc(size, fresh);
+    else data = heapAlloc(size, fresh);
+    if (data == nullptr) return nullptr;
+
+    countAlloc(data, requested);
+    return data;
+}
+
+// Allocates a block of memory of (at least) 'size' bytes.
+word_t *alloc(size_t size) {
+    return allocate(size, nullptr);
+}
+
+/* Frees the previously allocated block. */
+void free(word_t *data) {
+    countFree(data);
 
-    if (searchMode == SearchMode::FreeList) {
-        free_list.push_back(block);
-    } 
+    if (!isSlot(data) && isMapped(getHeader(data))) return unmapLarge(getHeader(data));
+    if (threadSafe) return cacheFree(data);
+    heapFree(data);
+}
+
+// ----------------------------------------------------------------
+
+// Reallocation -- growing a vector should not mean alloc + copy + free
+// every time. a block shrinks by splitting off its tail, and grows into
+// a free right neighbour or, as the top block, into the rest of its
+// arena. large objects are moved by the kernel with mremap.
+
+/* hands the tail of a used block back to the heap when it can be a
+   block of its own, merging it with a free neighbour */
+void releaseTail(Block *block, size_t size) {
+    if (!canSplit(block, size)) return;
+    split(block, size);
+    Block *rest = nextBlock(block);
+    removeFree(rest);
+    markUsed(rest, true);
+    heapFree(rest->data);
+}
+
+/**
+ * @brief resizes a heap block in place to 'size' bytes, returns false
+ when the space after it is taken. runs under the heap lock.
+ */
+
+bool resizeBlock(Block *block, size_t size) {
+    size = std::max(payloadSize(size), minPayload());
+    if (size > getSize(block)) {
+        Block *next = nextBlock(block);
+        if (!isUsed(next) && getSize(block) + allocSize(getSize(next)) >= size) {
+            removeFree(next);
+            setSize(block, getSize(block) + allocSize(getSize(next)));
+            count(stats().coalesces);
+        } else if (isEpilogue(next) && (char *)next + sizeof(word_t) == heap->brk &&
+                   _sbrk(size - getSize(block)) != (void *)-1) {
+            // the last block of the arena moves its epilogue up
+            setSize(block, size);
+            setHeader(nextBlock(block), kUsed);
+        } else {
+            return false;
+        }
+        setPrevUsed(nextBlock(block), true);
+    }
+
+    releaseTail(block, size);
+    return true;
+}
+
+/* moves a large object to a mapping of the new size. the kernel keeps
+   the offset into the page, so does the payload its alignment. */
+Block *remapLarge(Block *block, size_t size) {
+    char *start = mappingStart(block);
+    size_t offset = (char *)block - start;
+    size_t length = pageAlign(offset + allocSize(size));
+    size_t oldLength = offset + allocSize(getSize(block));
+    void *mem = mremap(start, oldLength, length, MREMAP_MAYMOVE);
+    if (mem == MAP_FAILED) return nullptr;
+
+    mapped_bytes += length - oldLength;
+    heap_bytes += length - oldLength;
+    block = (Block *)((char *)mem + offset);
+    setSize(block, length - offset - allocSize(0));
+    return block;
+}
+
+/* an in-place resize counts as freeing the old and allocating the new size */
+inline void countResize(word_t *data, size_t requested, size_t oldFootprint,
+                        size_t oldUsable) {
+    Counters &counters = stats();
+    count(counters.requestedBytes, requested);
+    count(counters.allocatedBytes, footprint(data));
+    count(counters.freedBytes, oldFootprint);
+    count(counters.allocsBySize[sizeBin(usableSize(data))]);
+    count(counters.freesBySize[sizeBin(oldUsable)]);
+}
+
+word_t *reallocate(word_t *data, size_t size) {
+    if (data == nullptr) return alloc(size);
+    if (size == 0) {
+        free(data);
+        return nullptr;
+    }
+    if (size > kMaxRequest) return nullptr;
+
+    size_t aligned = blockSize(size);
+    size_t oldFootprint = footprint(data);
+    size_t oldUsable = usableSize(data);
+    word_t *resized = nullptr;
+
+    if (isSlot(data)) {
+        if (aligned <= oldUsable) resized = data;
+    } else if (isMapped(getHeader(data))) {
+        if (aligned >= mmap_threshold) {
+            if (Block *block = remapLarge(getHeader(data), aligned)) resized = block->data;
+        }
+    } else if (aligned < mmap_threshold) {
+        HeapGuard guard(ownerOf(data));
+        if (resizeBlock(getHeader(data), aligned)) resized = data;
+    }
+    if (resized != nullptr) {
+        countResize(resized, size, oldFootprint, oldUsable);
+        return resized;
+    }
+
+    word_t *moved = alloc(size);
+    if (moved == nullptr) return nullptr;
+    memcpy(moved, data, std::min(usableSize(data), size));
+    free(data);
+    return moved;
+}
+
+/**
+ * @brief allocates zeroed memory for 'count' objects of 'size' bytes.
+ memory that comes straight from the OS is zero already and is not
+ cleared again.
+ */
+
+word_t *allocZeroed(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) return nullptr;
+    bool fresh = false;
+    word_t *data = allocate(count * size, &fresh);
+    if (data != nullptr && !fresh) memset(data, 0, count * size);
+    return data;
+}
+
+// ----------------------------------------------------------------
+
+// Aligned allocation -- SIMD buffers and per-thread data want whole
+// cache lines, I/O buffers whole pages. the heap over-allocates by the
+// alignment once, then gives the gap before the aligned payload and the
+// tail after it back as free blocks, so nothing stays padded.
+
+/**
+ * @brief allocates 'size' bytes at a multiple of 'alignment' from the
+ heap blocks. runs under the heap lock.
+ */
+
+word_t *alignedHeapAlloc(size_t size, size_t alignment) {
+    // a gap in front of the payload has to hold a free block
+    size = std::max(payloadSize(size), minPayload());
+    size_t minBlock = allocSize(minPayload());
+    word_t *data = blockAlloc(size + alignment + minBlock);
+    if (data == nullptr) return nullptr;
+
+    Block *block = getHeader(data);
+    size_t gap = alignUp((uintptr_t)data, alignment) - (uintptr_t)data;
+    while (gap != 0 && gap < minBlock) gap += alignment;
+
+    if (gap != 0) {
+        Block *lead = block;
+        block = (Block *)((char *)lead + gap);
+        setHeader(block, (getSize(lead) - gap) | kUsed | kPrevUsed);
+        setSize(lead, gap - allocSize(0));
+        heapFree(lead->data);
+    }
+    releaseTail(block, size);
+    return block->data;
+}
+
+word_t *allocAligned(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return nullptr;
+    if (alignment <= kMinAlign) return alloc(size);
+    if (size > SIZE_MAX - 2 * alignment - mmap_threshold) return nullptr;
+
+    size_t request = blockSize(size);
+    word_t *data;
+    if (request + alignment >= mmap_threshold) {
+        data = mapLarge(request, alignment);
+    } else {
+        HeapGuard guard(localHeap());
+
+        // runs are page aligned, so a slot size that is a multiple of
+        // the alignment puts every slot on it
+        size_t slot = alignUp(request, alignment);
+        data = nullptr;
+        if (searchMode == SearchMode::Bitmap && slot <= kBitmapLimit) data = bitmapAlloc(slot);
+        if (data == nullptr) data = alignedHeapAlloc(request, alignment);
+    }
+    if (data == nullptr) return nullptr;
+
+    countAlloc(data, size);
+    return data;
+}
+
+int memAlign(word_t **data, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    word_t *aligned = allocAligned(alignment, size);
+    if (aligned == nullptr) return ENOMEM;
+    *data = aligned;
+    return 0;
+}
+
+// ----------------------------------------------------------------
+
+// Regions -- resetHeap() rolls the whole heap back at once; a region does
+// the same for the memory of one request. it fills chunks mapped from the
+// OS by bumping a pointer, and a mark is just the chunk and the pointer.
+// chunks stay in a list after the one being filled, so rewinding only
+// moves the pointer back and the spare chunks are filled again next time.
+
+ // chunk size of regions, larger allocations get a chunk of their own
+ static size_t region_chunk = 64 << 10;
+
+struct Region::Chunk {
+    Chunk *next;
+    size_t size;
 };
 
+Region::~Region() {
+    release();
+}
+
+word_t *Region::alloc(size_t size, size_t alignment) {
+    char *data = (char *)alignUp((uintptr_t)top, alignment);
+    if (top == nullptr || data > end || size > (size_t)(end - data)) return grow(size, alignment);
+    top = data + size;
+    return (word_t *)data;
+}
+
+/* moves on to the next spare chunk, or maps one that fits */
+word_t *Region::grow(size_t size, size_t alignment) {
+    if (size > kMaxRequest) return nullptr;
+    size_t need = sizeof(Chunk) + alignment + size;
+    Chunk *next = current ? current->next : first;
+
+    if (next == nullptr || next->size < need) {
+        size_t length = std::max(region_chunk, pageAlign(need));
+        void *mem = mmap(0, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return nullptr;
+        mapped_bytes += length;
+        os_requests++;
+
+        Chunk *chunk = (Chunk *)mem;
+        chunk->size = length;
+        chunk->next = next;
+        if (current != nullptr) current->next = chunk;
+        else first = chunk;
+        next = chunk;
+    }
+    current = next;
+    top = (char *)current + sizeof(Chunk);
+    end = (char *)current + current->size;
+    return alloc(size, alignment);
+}
+
+Region::Mark Region::mark() const {
+    return {current, top};
+}
+
+void Region::rewind(Mark mark) {
+    current = mark.chunk;
+    top = mark.top;
+    end = current ? (char *)current + current->size : nullptr;
+}
+
+void Region::release() {
+    while (first != nullptr) {
+        Chunk *next = first->next;
+        mapped_bytes -= first->size;
+        munmap(first, first->size);
+        first = next;
+    }
+    current = nullptr;
+    top = end = nullptr;
+}
+
+Region &threadRegion() {
+    static thread_local Region region;
+    return region;
+}
+
+// ----------------------------------------------------------------
+
+// Garbage collection -- the collector of the header comment. objects from
+// gcAlloc() are never freed by the mutator, an incremental mark-sweep
+// collector frees the ones that can no longer be reached.
+//
+// roots are the registered pointer variables (precise) and every word on
+// the stack and in the registers of the collecting thread (conservative).
+// objects are scanned conservatively as well: a word pointing anywhere
+// into an object keeps it alive. sorting the objects for that, marking
+// and sweeping run in steps of at most gc_budget_ns. between steps the
+// mutator stores pointers into objects with gcWrite(), which shades the
+// stored object (Dijkstra's barrier), so a black object never hides a
+// white one. the stack and the roots have no barrier and are scanned once
+// more to finish marking, until a scan finds nothing new. objects
+// allocated while sorting or marking are born black.
+
+#include <chrono>
+#include <csetjmp>
+#include <vector>
+
+ // longest a collector step may run
+ static uint64_t gc_budget_ns = 500 * 1000;
+
+ // bytes gcAlloc hands out between two steps of a running cycle
+ static size_t gc_step_bytes = 64 << 10;
+
+ // a cycle starts once the bytes allocated since the last one reach the
+ // bytes that survived it, and at least this many
+ static size_t gc_min_trigger = 1 << 20;
+
+/* allocator of the collector's own tables. they come straight from the
+   OS, so they can grow under the heap lock and are never scanned. */
+template <typename T>
+struct OsAllocator {
+    using value_type = T;
+
+    OsAllocator() = default;
+    template <typename U> OsAllocator(const OsAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        void *mem = mmap(0, pageAlign(n * sizeof(T)), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) throw std::bad_alloc();
+        mapped_bytes += pageAlign(n * sizeof(T));
+        return (T *)mem;
+    }
+
+    void deallocate(T *p, size_t n) {
+        munmap(p, pageAlign(n * sizeof(T)));
+        mapped_bytes -= pageAlign(n * sizeof(T));
+    }
+
+    bool operator==(const OsAllocator &) const { return true; }
+};
+
+template <typename T>
+using OsVector = std::vector<T, OsAllocator<T>>;
+
+using GcClock = std::chrono::steady_clock;
+
+enum class GcPhase { Idle, Sort, Mark, Sweep };
+
+static GcPhase gcPhase = GcPhase::Idle;
+static OsVector<Block *> gcObjects;     // every collected object
+static size_t gcSorted = 0;             // objects at the front sorted by address
+static OsVector<Block *> gcGray;        // marked, contents not scanned yet
+static OsVector<word_t *> gcPending;    // stored while sorting, shaded once marking begins
+static OsVector<word_t **> gcRoots;
+static size_t gcSwept = 0, gcKept = 0, gcSweepEnd = 0, gcSortedKept = 0;
+static size_t gcLive = 0;               // bytes that survived the last cycle
+static size_t gcAllocated = 0;          // bytes allocated since it began
+static size_t gcSinceStep = 0;
+static unsigned gcEpoch = 0;
+
+/* a reset heap took the collected objects with it */
+inline void gcCheckEpoch() {
+    unsigned epoch = heapEpoch.load(std::memory_order_relaxed);
+    if (gcEpoch == epoch) return;
+    gcObjects.clear();
+    gcGray.clear();
+    gcPending.clear();
+    gcPhase = GcPhase::Idle;
+    gcSorted = gcLive = gcAllocated = gcSinceStep = 0;
+    gcEpoch = epoch;
+}
+
+// Sorting -- a cycle starts by sorting the objects for gcFind(). the ones
+// the last sweep kept are still sorted at the front, the others are
+// sorted in runs of kGcRun, the runs merged pairwise until they are one,
+// and that one merged with the front. a merge copies its left run aside
+// and merges it back in place, so it can stop after any element.
+
+constexpr size_t kGcRun = 1024;
+
+struct GcSort {
+    size_t from, end;           // the objects not sorted yet
+    size_t width, at;           // runs of 'width' from 'at' on are next, 0 while cutting them
+    size_t lo, mid, hi;         // the merge in progress, if lo < hi
+    size_t copied, left, right, out;
+};
+
+static GcSort gcSort;
+static Block **gcBuffer = nullptr;      // left run of the merge in progress
+static size_t gcBufferSize = 0;
+
+void gcMergeBegin(size_t lo, size_t mid, size_t hi) {
+    if (gcBufferSize < mid - lo) {
+        OsAllocator<Block *> os;
+        if (gcBuffer != nullptr) os.deallocate(gcBuffer, gcBufferSize);
+        gcBufferSize = std::max(mid - lo, 2 * gcBufferSize);
+        gcBuffer = os.allocate(gcBufferSize);
+    }
+    gcSort.lo = lo;
+    gcSort.mid = mid;
+    gcSort.hi = hi;
+    gcSort.copied = gcSort.left = 0;
+    gcSort.right = mid;
+    gcSort.out = lo;
+}
+
+/* moves one element of the merge, returns false once it is done */
+inline bool gcMergeOne() {
+    GcSort &s = gcSort;
+    Block **objects = gcObjects.data();
+    size_t length = s.mid - s.lo;
+    if (s.copied < length) {
+        gcBuffer[s.copied] = objects[s.lo + s.copied];
+        s.copied++;
+        return true;
+    }
+    // the rest of the right run is in place already
+    if (s.left == length) return false;
+    if (s.right < s.hi && objects[s.right] < gcBuffer[s.left]) objects[s.out++] = objects[s.right++];
+    else objects[s.out++] = gcBuffer[s.left++];
+    return true;
+}
+
+/* sorts the objects until the deadline, returns true once they are */
+bool gcSortStep(GcClock::time_point deadline) {
+    GcSort &s = gcSort;
+    for (size_t n = 1;; ++n) {
+        if (s.lo < s.hi) {
+            if (!gcMergeOne()) s.lo = s.hi = 0;
+        } else if (s.width == 0) {
+            if (s.at < s.end) {
+                size_t to = std::min(s.at + kGcRun, s.end);
+                std::sort(gcObjects.begin() + s.at, gcObjects.begin() + to);
+                s.at = to;
+                n += kGcRun;
+            } else {
+                s.width = kGcRun;
+                s.at = s.from;
+            }
+        } else if (s.at + s.width < s.end) {
+            size_t mid = s.at + s.width, hi = std::min(mid + s.width, s.end);
+            gcMergeBegin(s.at, mid, hi);
+            s.at = hi;
+        } else if (s.width < s.end - s.from) {
+            s.width *= 2;
+            s.at = s.from;
+        } else if (s.from > 0 && s.from < s.end) {
+            gcMergeBegin(0, s.from, s.end);
+            s.from = s.end;
+        } else {
+            return true;
+        }
+        if (n >= 256) {
+            if (GcClock::now() >= deadline) return false;
+            n = 0;
+        }
+    }
+}
+
+/* the object the word points into, if it is one from before marking began */
+Block *gcFind(word_t word) {
+    auto end = gcObjects.begin() + gcSorted;
+    auto it = std::upper_bound(gcObjects.begin(), end, (Block *)word);
+    if (it == gcObjects.begin()) return nullptr;
+    Block *block = *(it - 1);
+    uintptr_t data = (uintptr_t)block->data;
+    return (uintptr_t)word >= data && (uintptr_t)word < data + getSize(block) ? block : nullptr;
+}
+
+/* greys the object the word points into */
+inline void gcShade(word_t word) {
+    Block *block = gcFind(word);
+    if (block == nullptr || isMarked(block)) return;
+    setMarked(block, true);
+    gcGray.push_back(block);
+}
+
+/* treats every word in the range as a possible pointer. stack frames hold
+   redzones the address sanitizer would report, they are fine to read. */
+__attribute__((no_sanitize_address))
+void gcScan(char *from, char *to) {
+    for (word_t *word = (word_t *)alignUp((uintptr_t)from, sizeof(word_t)); (char *)(word + 1) <= to; ++word)
+        gcShade(*word);
+}
+
+/* the highest address of the calling thread's stack */
+char *stackTop() {
+    static thread_local char *top = nullptr;
+    if (top == nullptr) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        top = (char *)addr + size;
+    }
+    return top;
+}
+
+/* the mutator's stack, from the registers it spilled when it entered
+   the collector up to its top. frames of the collector itself lie below
+   and are full of stale object pointers. */
+struct GcStack {
+    char *bottom, *top;
+};
+
+/* greys the registered roots and the words on the mutator's stack */
+void gcScanRoots(GcStack stack) {
+    gcScan(stack.bottom, stack.top);
+    for (word_t **root : gcRoots) gcShade((word_t)*root);
+}
+
+/* scans grey objects until the deadline, returns true when none is left */
+bool gcMark(GcClock::time_point deadline) {
+    for (size_t n = 1; !gcGray.empty(); ++n) {
+        Block *block = gcGray.back();
+        gcGray.pop_back();
+        gcScan((char *)block->data, (char *)block->data + getSize(block));
+        if (n % 16 == 0 && GcClock::now() >= deadline) return false;
+    }
+    return true;
+}
+
+/* frees the unmarked objects until the deadline and unmarks the rest,
+   returns true when the cycle is done */
+bool gcSweep(GcClock::time_point deadline) {
+    for (size_t n = 1; gcSwept < gcSweepEnd; ++n) {
+        Block *block = gcObjects[gcSwept++];
+        if (isMarked(block)) {
+            setMarked(block, false);
+            gcLive += getSize(block);
+            gcObjects[gcKept++] = block;
+        } else {
+            countFree(block->data);
+            if (isMapped(block)) {
+                unmapLarge(block);
+            } else {
+                // no trim inside the step, the next free or heapTrim() does it
+                heap->freedSinceTrim += allocSize(getSize(block));
+                releaseBlock(block);
+            }
+        }
+        // the kept ones of the sorted front stay sorted for the next cycle
+        if (gcSwept == gcSorted) gcSortedKept = gcKept;
+        if (n % 64 == 0 && GcClock::now() >= deadline) return false;
+    }
+    // objects allocated while sweeping follow the swept ones
+    gcObjects.erase(gcObjects.begin() + gcKept, gcObjects.begin() + gcSweepEnd);
+    gcSorted = gcSortedKept;
+    return true;
+}
+
+/**
+ * @brief one step of the collector, returns true when it ends a cycle.
+ * a cycle sorts the objects until the deadline, then greys the roots and
+ marks until the deadline. to finish marking a step rescans the roots,
+ marks what that greyed, and sweeps once a rescan found nothing. every
+ part stops at the deadline, except the scans of the roots and the
+ stack: their cost is that of the root set.
+ */
+
+bool gcRun(GcStack stack, GcClock::time_point deadline) {
+    // the headers share their word with the heap's prev-used bit.
+    // collected objects all come from the first shard.
+    HeapGuard guard(heaps);
+
+    switch (gcPhase) {
+        case GcPhase::Idle:
+            gcSort = {gcSorted, gcObjects.size(), 0, gcSorted, 0, 0, 0, 0, 0, 0, 0};
+            gcAllocated = 0;
+            gcPhase = GcPhase::Sort;
+            [[fallthrough]];
+        case GcPhase::Sort:
+            if (!gcSortStep(deadline)) return false;
+            gcSorted = gcSort.end;
+            gcPhase = GcPhase::Mark;
+            for (word_t *stored : gcPending) gcShade((word_t)stored);
+            gcPending.clear();
+            gcScanRoots(stack);
+            return false;
+        case GcPhase::Mark:
+            // the stack and the roots changed without a barrier
+            for (;;) {
+                if (!gcMark(deadline)) return false;
+                gcScanRoots(stack);
+                if (gcGray.empty()) break;
+                if (GcClock::now() >= deadline) return false;
+            }
+            gcSwept = gcKept = gcLive = gcSortedKept = 0;
+            gcSweepEnd = gcObjects.size();
+            gcPhase = GcPhase::Sweep;
+            return false;
+        case GcPhase::Sweep:
+            if (!gcSweep(deadline)) return false;
+            gcPhase = GcPhase::Idle;
+            return true;
+    }
+    return false;
+}
+
+bool gcStep() {
+    // callee-saved registers, spilled onto the stack. the buffer is
+    // cleared first, setjmp leaves its signal mask part untouched
+    jmp_buf registers = {};
+    setjmp(registers);
+    gcCheckEpoch();
+    GcStack stack = {(char *)&registers, stackTop()};
+    return gcRun(stack, GcClock::now() + std::chrono::nanoseconds(gc_budget_ns));
+}
+
+void gcCollect() {
+    jmp_buf registers = {};
+    setjmp(registers);
+    gcCheckEpoch();
+    GcStack stack = {(char *)&registers, stackTop()};
+    // a cycle that is already running started before the latest garbage
+    if (gcPhase != GcPhase::Idle) while (!gcRun(stack, GcClock::time_point::max()));
+    while (!gcRun(stack, GcClock::time_point::max()));
+    HeapGuard guard(heaps);
+    checkTrim();
+}
+
+void gcPauseBudget(uint64_t microseconds) {
+    gc_budget_ns = microseconds * 1000;
+}
+
+/* objects allocated while the cycle sorts or marks are kept by it */
+inline bool gcBornBlack() {
+    return gcPhase == GcPhase::Sort || gcPhase == GcPhase::Mark;
+}
+
+word_t *gcAlloc(size_t requested) {
+    if (requested > kMaxRequest) return nullptr;
+    gcCheckEpoch();
+    // heap blocks only, bitmap slots have no header to mark
+    size_t size = std::max(payloadSize(requested), minPayload());
+    bool fresh = false;
+
+    word_t *data;
+    if (size >= mmap_threshold) {
+        data = mapLarge(size);
+        if (data != nullptr && gcBornBlack()) setMarked(getHeader(data), true);
+        fresh = true;
+    } else {
+        HeapGuard guard(heaps);
+        data = blockAlloc(size, &fresh);
+        if (data != nullptr && gcBornBlack()) setMarked(getHeader(data), true);
+    }
+    if (data == nullptr) return nullptr;
+    // stale words of a reused block would keep other objects alive. the
+    // block can be larger than asked for and gcScan reads all of it
+    if (!fresh) memset(data, 0, getSize(getHeader(data)));
+    gcObjects.push_back(getHeader(data));
+    countAlloc(data, requested);
+
+    gcAllocated += size;
+    if (gcPhase == GcPhase::Idle) {
+        if (gcAllocated >= std::max(gc_min_trigger, gcLive)) gcStep();
+    } else if ((gcSinceStep += size) >= gc_step_bytes) {
+        gcSinceStep = 0;
+        gcStep();
+    }
+    return data;
+}
+
+void gcWrite(word_t **slot, word_t *value) {
+    if (gcPhase == GcPhase::Mark) {
+        HeapGuard guard(heaps);
+        gcShade((word_t)value);
+    } else if (gcPhase == GcPhase::Sort && value != nullptr) {
+        gcPending.push_back(value);
+    }
+    *slot = value;
+}
+
+void gcAddRoot(word_t **root) {
+    gcRoots.push_back(root);
+}
+
+void gcRemoveRoot(word_t **root) {
+    gcRoots.erase(std::remove(gcRoots.begin(), gcRoots.end(), root), gcRoots.end());
+}
+
+// ----------------------------------------------------------------
+
+size_t heapMapped() {
+    return mapped_bytes.load(std::memory_order_relaxed);
+}
+
+size_t heapSize() {
+    return heap_bytes.load(std::memory_order_relaxed);
+}
+
+void heapHugePages(bool enable) {
+    huge_pages = enable;
+}
+
+void heapDeferFree(bool enable) {
+    defer_frees = enable;
+    if (enable) return;
+    for (int i = 0; i < shardCount; ++i) {
+        HeapGuard guard(&heaps[i]);
+        drainFrees();
+    }
+}
+
+void heapTrim() {
+    for (int i = 0; i < shardCount; ++i) {
+        HeapGuard guard(&heaps[i]);
+        drainFrees();
+        trimHeap();
+    }
+}
+
+HeapUsage heapUsage() {
+    HeapUsage usage = {heapMapped(), 0, 0, 0};
+    for (int i = 0; i < shardCount; ++i) {
+        HeapGuard guard(&heaps[i]);
+        for (Arena *a = heap->arena; a != nullptr; a = a->next) {
+            for (Block *block = firstBlock(a); !isEpilogue(block); block = nextBlock(block)) {
+                size_t size = getSize(block);
+                if (isUsed(block)) {
+                    usage.used += size;
+                    continue;
+                }
+                usage.free += size;
+                if (size > usage.largestFree) usage.largestFree = size;
+            }
+        }
+    }
+    return usage;
+}
+
+HeapStats heapStats() {
+    HeapStats result = {};
+    uint64_t requested = 0, allocated = 0, freed = 0;
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        for (Counters *slot = statsSlots; slot != nullptr; slot = slot->next) {
+            result.allocs += slot->allocs;
+            result.frees += slot->frees;
+            result.searches += slot->searches;
+            result.blocksSearched += slot->blocksSearched;
+            result.splits += slot->splits;
+            result.coalesces += slot->coalesces;
+            result.cacheHits += slot->cacheHits;
+            requested += slot->requestedBytes;
+            allocated += slot->allocatedBytes;
+            freed += slot->freedBytes;
+            for (int bin = 0; bin < kSizeBins; ++bin) {
+                result.liveBySize[bin] += slot->allocsBySize[bin] - slot->freesBySize[bin];
+            }
+        }
+    }
+    result.osRequests = os_requests;
+    result.mappedBytes = heapMapped();
+    result.hugeBytes = huge_bytes;
+    result.liveBytes = allocated - freed;
+    if (allocated) result.internalFrag = 1.0 - (double)requested / allocated;
+
+    HeapUsage usage = heapUsage();
+    if (usage.free) result.externalFrag = 1.0 - (double)usage.largestFree / usage.free;
+    return result;
+}
+
 
 /**
  * @brief test main file logic
@@ -443,18 +2645,643 @@ void free(word_t *data) {
  */
 
 
+#ifndef MEM_ALLOC_NO_MAIN
+
+#include <thread>
+#include <vector>
+
+/* checks the red-black rules below the node, returns its black height */
+int treeCheck(Block *node) {
+    if (node == nullptr) return 1;
+    for (Block *c : {child(node)[0], child(node)[1]}) {
+        if (c == nullptr) continue;
+        assert(parentOf(c) == node && !isUsed(c));
+        assert(!(isRed(node) && isRed(c)));
+    }
+    assert(!child(node)[0] || treeLess(child(node)[0], node));
+    assert(!child(node)[1] || treeLess(node, child(node)[1]));
+    int height = treeCheck(child(node)[0]);
+    assert(height == treeCheck(child(node)[1]));
+    return height + !isRed(node);
+}
+
+/* checks the next-fit list holds every free block in address order and
+   the roving pointer is one of them */
+void addressCheck() {
+    size_t listed = 0, free = 0;
+    bool rover = heap->searchStart == nullptr;
+    for (Block *b = heap->addressHead; b != nullptr; b = getLinks(b)->next) {
+        Block *next = getLinks(b)->next;
+        assert(!isUsed(b) && (next ? getLinks(next)->prev == b && b < next : heap->addressTail == b));
+        rover |= b == heap->searchStart;
+        listed++;
+    }
+    for (Arena *a = heap->arena; a; a = a->next)
+        for (Block *b = firstBlock(a); !isEpilogue(b); b = nextBlock(b)) free += !isUsed(b);
+    assert(listed == free && rover);
+}
+
+/* checks the trim list holds exactly the flagged free blocks, returns
+   how many */
+size_t trimCheck() {
+    size_t listed = 0, flagged = 0;
+    for (Block *b = heap->trimHead, *prev = nullptr; b != nullptr; prev = b, b = getTrimLinks(b)->next) {
+        assert(!isUsed(b) && (getHeaderWord(b) & kTrimListed) && getSize(b) >= trim_threshold);
+        assert(getTrimLinks(b)->prev == prev);
+        listed++;
+    }
+    for (Arena *a = heap->arena; a; a = a->next)
+        for (Block *b = firstBlock(a); !isEpilogue(b); b = nextBlock(b)) flagged += (getHeaderWord(b) & kTrimListed) != 0;
+    assert(listed == flagged);
+    return listed;
+}
+
+/* a list of 'n' collected nodes {next, value}, returns its head */
+__attribute__((noinline)) word_t *gcList(int n) {
+    word_t *head = nullptr;
+    for (int i = 0; i < n; ++i) {
+        word_t *node = gcAlloc(2 * sizeof(word_t));
+        gcWrite((word_t **)&node[0], head);
+        node[1] = i;
+        head = node;
+    }
+    return head;
+}
+
+/* overwrites dead frames, so stale pointers in them keep nothing alive */
+__attribute__((noinline)) void clearStack() {
+    volatile char junk[16 << 10];
+    for (char &c : (char(&)[16 << 10])junk) c = 0;
+}
+
+/* checks that a list of 'n' nodes is intact */
+void gcCheckList(word_t *head, int n) {
+    for (int i = n - 1; i >= 0; --i, head = (word_t *)head[0]) {
+        assert(isUsed(getHeader(head)) && head[1] == i);
+    }
+    assert(head == nullptr);
+}
+
+static word_t *gcRoot = nullptr;
+
+/* hangs the second node of the root list off a new object, which is born
+   black while the cycle sorts, and cuts it out of the list */
+__attribute__((noinline)) void gcMoveWhileSorting() {
+    word_t *fresh = gcAlloc(2 * sizeof(word_t));
+    word_t *second = (word_t *)gcRoot[0];
+    gcWrite((word_t **)&fresh[0], second);
+    gcWrite((word_t **)&gcRoot[0], (word_t *)second[0]);
+    gcWrite((word_t **)&gcRoot[1], fresh);
+}
+
+/* keeps objects alive through the root, the stack and an interior
+   pointer, and drops them all again before it returns */
+__attribute__((noinline)) void gcReachable() {
+    gcRoot = gcList(1000);
+    word_t *volatile onStack = gcAlloc(64);
+    word_t *volatile inside = gcAlloc(64) + 5;
+    for (int i = 0; i < 1000; ++i) gcAlloc(16);             // garbage
+    clearStack();
+    gcCollect();
+    gcCheckList(gcRoot, 1000);
+    assert(isUsed(getHeader(onStack)) && isUsed(getHeader(inside - 5)));
+    assert(gcObjects.size() <= 1002 + 8);                   // a few may stay, conservatively
+    gcRoot = nullptr;
+}
+
+/* the collector tests, run on a fresh stack */
+void gcTests() {
+    // registered roots and the stack keep objects alive, everything else
+    // is freed
+    gcAddRoot(&gcRoot);
+    gcReachable();
+    clearStack();
+    gcCollect();
+    assert(gcObjects.size() <= 8);
+
+    // incremental marking: the write barrier keeps an object alive that
+    // moves behind an already scanned one while the cycle runs
+    gcPauseBudget(0);
+    gcRoot = gcList(20000);
+    int steps = 1;
+    clearStack();
+    for (gcStep(); gcPhase == GcPhase::Sort; steps++) {     // sorts, then greys the roots
+        assert(std::is_sorted(gcObjects.begin(), gcObjects.begin() + gcSorted));
+        gcStep();
+    }
+    assert(steps > 1 && std::is_sorted(gcObjects.begin(), gcObjects.begin() + gcSorted));
+    gcStep();                                               // marks a few nodes
+    steps++;
+    word_t *last = gcRoot;
+    while (((word_t *)last[0])[0] != 0) last = (word_t *)last[0];
+    word_t *moved = (word_t *)last[0];                      // node 0, scanned last
+    assert(gcPhase == GcPhase::Mark && !isMarked(getHeader(moved)));
+    gcWrite((word_t **)&gcRoot[1], moved);                  // the head was scanned already
+    gcWrite((word_t **)&last[0], nullptr);
+    last = moved = nullptr;
+    while (!gcStep()) steps++;
+    assert(steps > 10 && isUsed(getHeader((word_t *)gcRoot[1])));
+    assert(((word_t *)gcRoot[1])[1] == 0);
+
+    // stores while sorting are shaded once marking begins
+    gcRoot = gcList(20000);
+    clearStack();
+    gcStep();
+    assert(gcPhase == GcPhase::Sort);
+    gcMoveWhileSorting();
+    clearStack();
+    while (!gcStep());
+    word_t *second = (word_t *)((word_t *)gcRoot[1])[0];
+    assert(isUsed(getHeader(second)) && second[1] == 19998);
+    second = nullptr;
+
+    // cycles start from gcAlloc, and garbage does not pile up
+    gcPauseBudget(500);
+    gcRoot = nullptr;
+    size_t objects = gcObjects.size();
+    for (int i = 0; i < 100000; ++i) gcAlloc(200);
+    assert(gcObjects.size() < objects + 100000);
+    clearStack();
+    gcCollect();
+    assert(heapUsage().used < (1 << 20));
+
+    // a reused block too large to fit exactly but too small to split is
+    // cleared all the way, its tail would keep stale objects alive
+    word_t *before = alloc(64), *stale = alloc(64 + sizeof(word_t)), *after = alloc(64);
+    size_t words = getSize(getHeader(stale)) / sizeof(word_t);
+    for (size_t i = 0; i < words; ++i) stale[i] = (word_t)stale;
+    free(stale);
+    word_t *cleared = gcAlloc(64);
+    assert(cleared == stale && getSize(getHeader(cleared)) > 64);
+    for (size_t i = 0; i < words; ++i) assert(cleared[i] == 0);
+    free(before);
+    free(after);
+    gcRemoveRoot(&gcRoot);
+}
+
 // to test the allocation
 int main(int argc, char const *argv[]) {
     word_t* p1 = alloc(3);
     Block* p1b = getHeader(p1);
-    assert(p1b->size == sizeof(word_t));
+    assert(getSize(p1b) == sizeof(word_t));
 
     word_t *p2 = alloc(8);
     Block *p2b = getHeader(p2);
-    assert(p2b->size == 8);
+    assert(getSize(p2b) == 8);
+    assert(p2b == nextBlock(p1b) && isPrevUsed(p2b));
 
     free(p2);
-    assert(p2b->used == false);
+    assert(isUsed(p2b) == false && prevBlock(nextBlock(p2b)) == p2b);
+
+    // a used block costs one header word
+    assert(allocSize(8) == 2 * sizeof(word_t));
+
+    // boundary tags: freeing a block between two free ones merges all three
+    word_t *p3 = alloc(16);
+    word_t *p4 = alloc(16);
+    word_t *p5 = alloc(16);
+    word_t *p6 = alloc(16);
+    free(p3);
+    free(p5);
+    assert(getSize(p2b) == 8 + allocSize(16));
+    free(p4);
+    assert(getSize(p2b) == 8 + 3 * 16 + 3 * allocSize(0));
+    assert(nextBlock(p2b) == getHeader(p6) && !isPrevUsed(getHeader(p6)));
+
+    // splitting hands out the front and keeps the rest free
+    word_t *p7 = alloc(8);
+    assert(getHeader(p7) == p2b && getSize(p2b) == 8);
+    assert(!isUsed(nextBlock(p2b)) && nextBlock(nextBlock(p2b)) == getHeader(p6));
+    assert(isEpilogue(nextBlock(getHeader(p6))));
+
+    // segregated lists: sizes map to classes, freed blocks are reused
+    // from their class and split remainders move to a smaller class
+    init(SearchMode::SegregatedList);
+    assert(getBucket(8) == 0 && getBucket(504) == kSmallClasses - 1);
+    assert(getBucket(512) == kSmallClasses);
+    assert(getBucket(SIZE_MAX) == kNumClasses - 1);
+
+    word_t *s1 = alloc(24);
+    word_t *s2 = alloc(4096);
+    word_t *s3 = alloc(24);
+    free(s1);
+    assert(heap->segregatedLists[getBucket(24)] == getHeader(s1));
+    assert(alloc(24) == s1 && heap->segregatedLists[getBucket(24)] == nullptr);
+
+    free(s2);
+    word_t *s4 = alloc(1000);
+    assert(s4 == s2);
+    Block *rest = nextBlock(getHeader(s4));
+    assert(!isUsed(rest) && heap->segregatedLists[getBucket(getSize(rest))] == rest);
+
+    free(s4);
+    assert(getSize(getHeader(s4)) == 4096 && heap->segregatedLists[getBucket(4096)] == getHeader(s4));
+    free(s3);
+
+    // best fit: the tree returns the same block a full scan of the heap
+    // would pick, and stays balanced under churn
+    init(SearchMode::BestFit);
+    const int count = 2000;
+    static word_t *blocks[count];
+    unsigned seed = 1;
+    for (int i = 0; i < count; ++i) {
+        seed = seed * 1103515245 + 12345;
+        blocks[i] = alloc(8 + (seed >> 16) % 512);
+    }
+    for (int i = 0; i < count; i += 2) free(blocks[i]);
+    treeCheck(heap->treeRoot);
+
+    for (int i = 0; i < count; i += 2) {
+        seed = seed * 1103515245 + 12345;
+        size_t size = align(8 + (seed >> 16) % 256);
+        if (size < minPayload()) size = minPayload();
+        Block *expected = nullptr;
+        for (Block *b = firstBlock(heap->arena); !isEpilogue(b); b = nextBlock(b)) {
+            if (isUsed(b) || getSize(b) < size) continue;
+            if (expected == nullptr || getSize(b) < getSize(expected)) expected = b;
+        }
+        blocks[i] = alloc(size);
+        assert(expected == nullptr || getHeader(blocks[i]) == expected);
+    }
+    treeCheck(heap->treeRoot);
+    for (int i = 0; i < count; ++i) free(blocks[i]);
+    assert(heap->treeRoot == firstBlock(heap->arena) && !child(heap->treeRoot)[0] && !child(heap->treeRoot)[1]);
+
+    // next fit: searches resume after the last block handed out, wrap
+    // around at the end of the list, and the rover survives merges
+    init(SearchMode::NextFit);
+    word_t *holes[8];
+    for (int i = 0; i < 8; ++i) holes[i] = alloc(64), alloc(64);
+    for (int i : {1, 3, 5}) free(holes[i]);
+    assert(alloc(64) == holes[1] && heap->searchStart == getHeader(holes[3]));
+    free(holes[1]);
+    assert(alloc(64) == holes[3] && alloc(64) == holes[5]);
+    assert(heap->searchStart == nullptr && alloc(64) == holes[1]);  // wrapped
+    addressCheck();
+
+    free(holes[6]);
+    word_t *front = alloc(16);                                // split, rover stays on the rest
+    assert(front == holes[6] && heap->searchStart == nextBlock(getHeader(front)));
+    free(front);                                              // merges into the rover's block
+    assert(heap->searchStart == getHeader(holes[6]));
+    addressCheck();
+
+    for (int i = 0; i < count; ++i) {
+        seed = seed * 1103515245 + 12345;
+        blocks[i] = alloc(8 + (seed >> 16) % 512);
+    }
+    for (int round = 0; round < 4; ++round) {
+        for (int i = round & 1; i < count; i += 2) {
+            if (blocks[i]) free(blocks[i]);
+            seed = seed * 1103515245 + 12345;
+            blocks[i] = (seed >> 16) % 3 ? alloc(8 + (seed >> 16) % 256) : nullptr;
+        }
+        addressCheck();
+    }
+    for (int i = 0; i < count; ++i) if (blocks[i]) free(blocks[i]);
+    addressCheck();
+
+    // deferred frees: freed blocks stay used until an allocation misses,
+    // then neighbours are merged as one run and the run is reused
+    init(SearchMode::SegregatedList);
+    heapDeferFree(true);
+    word_t *graph[64];
+    for (int i = 0; i < 64; ++i) graph[i] = alloc(48);
+    word_t *guard = alloc(48);
+    uint64_t coalesces = heapStats().coalesces;
+    for (int i = 63; i >= 0; i -= 2) free(graph[i]);
+    for (int i = 62; i >= 0; i -= 2) free(graph[i]);
+    assert(isUsed(getHeader(graph[0])) && heapUsage().free == 0);
+    word_t *whole = alloc(64 * 48);
+    assert(whole == graph[0] && heapStats().coalesces == coalesces + 63);
+    size_t leftover = heapUsage().free;                   // split off the run
+    free(whole);
+    free(guard);
+    assert(heapUsage().free == leftover);
+    heapDeferFree(false);                                 // drains the rest
+    assert(heapUsage().free == getSize(getHeader(graph[0])));
+
+    // a full buffer drains by itself
+    heapDeferFree(true);
+    static word_t *parked[kDeferMax];
+    for (int i = 0; i < kDeferMax; ++i) parked[i] = alloc(32 + i % 4 * 16);
+    for (int i = 0; i < kDeferMax; ++i) free(parked[i]);
+    assert(heap->deferredCount == 0 && heapUsage().used == 0);
+    heapDeferFree(false);
+
+    // thread-safe mode: workers churn through their caches and shards, and
+    // once they exit and the shards drained their remote frees every block
+    // is back in the heap (or its run)
+    heap_shards = 4;
+    for (SearchMode mode : {SearchMode::SegregatedList, SearchMode::Bitmap}) {
+        init(mode, true);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < 8; ++t) {
+            workers.emplace_back([t] {
+                word_t *live[64] = {};
+                unsigned rnd = t + 1;
+                for (int i = 0; i < 100000; ++i) {
+                    rnd = rnd * 1103515245 + 12345;
+                    int slot = (rnd >> 8) % 64;
+                    if (live[slot] != nullptr) {
+                        assert(*live[slot] == (word_t)slot);
+                        free(live[slot]);
+                    }
+                    live[slot] = alloc(i % 100 == 0 ? 4096 : 8 + (rnd >> 16) % 200);
+                    *live[slot] = slot;
+                }
+                for (word_t *data : live) free(data);
+            });
+        }
+        for (auto &worker : workers) worker.join();
+        heapTrim();
+        for (int i = 0; i < shardCount; ++i) {
+            for (Arena *a = heaps[i].arena; a != nullptr; a = a->next) {
+                for (Block *b = firstBlock(a); !isEpilogue(b); b = nextBlock(b)) assert(!isUsed(b));
+            }
+        }
+        for (size_t r = 0; r < runCount; ++r) assert(runMeta[r].freeSlots == runMeta[r].slots);
+    }
+
+    // a block freed from another shard waits on the owner's remote list
+    // until the owner takes its lock. the thread is pinned to its CPU so
+    // its own shard stays the same.
+    init(SearchMode::FirstFit, true);
+    cpu_set_t cpus, pinned;
+    sched_getaffinity(0, sizeof(cpus), &cpus);
+    CPU_ZERO(&pinned);
+    CPU_SET(sched_getcpu(), &pinned);
+    sched_setaffinity(0, sizeof(pinned), &pinned);
+    Heap *other = &heaps[(localHeap() - heaps + 1) % shardCount];
+    word_t *remote;
+    {
+        HeapGuard guard(other);
+        remote = heapAlloc(1024);
+    }
+    assert(ownerOf(remote) == other && other != localHeap());
+    free(remote);
+    assert(other->remoteFrees == remote && isUsed(getHeader(remote)));
+    word_t *local = alloc(1024);
+    assert(ownerOf(local) == localHeap() && other->remoteFrees == remote);
+    free(local);
+    { HeapGuard guard(other); }
+    assert(other->remoteFrees == nullptr && !isUsed(getHeader(remote)));
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+    heap_shards = 0;
+
+    // arenas: the heap spills into new arenas, large objects get their
+    // own mapping, and freed pages are no longer resident
+    init(SearchMode::FirstFit);
+    unsigned char resident;
+    word_t *large = alloc(1 << 20);
+    assert(isMapped(getHeader(large)) && heap->arena == nullptr);
+    free(large);
+    assert(mincore(getHeader(large), pageSize(), &resident) == -1);
+
+    word_t *chunks[64];
+    for (auto &chunk : chunks) {
+        chunk = alloc(100 << 10);
+        for (size_t i = 0; i < (100 << 10) / sizeof(word_t); ++i) chunk[i] = i;
+    }
+    assert(heap->arena->next != nullptr && !isMapped(getHeader(chunks[63])));
+    for (auto &chunk : chunks) free(chunk);
+    mincore((void *)pageAlign((uintptr_t)chunks[10] + pageSize()), pageSize(), &resident);
+    assert((resident & 1) == 0);
+
+    // a trim only visits the free blocks large enough to give pages back:
+    // scattered small frees list nothing, a merged large block is listed
+    // until the next trim and again once it grows
+    for (SearchMode mode : {SearchMode::FirstFit, SearchMode::SegregatedList, SearchMode::BestFit}) {
+        init(mode);
+        std::vector<word_t *> smalls(4096);
+        for (auto &small : smalls) small = alloc(48);
+        for (size_t i = 0; i < smalls.size(); i += 2) free(smalls[i]);
+        assert(trimCheck() == 0);
+        for (size_t i = 1; i < 2048; i += 2) free(smalls[i]);
+        assert(trimCheck() == 1 && heap->trimHead == getHeader(smalls[0]));
+        heapTrim();
+        assert(trimCheck() == 0 && !isUsed(getHeader(smalls[0])));
+        // merging the trimmed block lists it again
+        for (size_t i = 2049; i < smalls.size(); i += 2) free(smalls[i]);
+        assert(trimCheck() == 1);
+    }
+
+    // statistics: counters follow what the heap did
+    init(SearchMode::FirstFit);
+    HeapStats before = heapStats();
+    word_t *a = alloc(64);
+    word_t *b = alloc(64);
+    word_t *c = alloc(64);
+    free(b);
+    free(a);
+    word_t *d = alloc(24);
+    HeapStats after = heapStats();
+    assert(after.allocs - before.allocs == 4 && after.frees - before.frees == 2);
+    assert(after.searches - before.searches == 4);
+    assert(after.coalesces - before.coalesces == 1 && after.splits - before.splits == 1);
+    assert(after.liveBytes - before.liveBytes == allocSize(64) + allocSize(24));
+    assert(after.liveBySize[sizeBin(24)] - before.liveBySize[sizeBin(24)] == 1);
+    assert(after.externalFrag == 0 && after.internalFrag > 0);
+    free(c);
+    free(d);
+
+    // bitmap runs: small slots are handed out lowest first, a freed slot
+    // is found again, and larger requests still get a block
+    init(SearchMode::Bitmap);
+    word_t *slots[kRunSize / 16 + 1];
+    for (auto &slot : slots) *(slot = alloc(16)) = 1;
+    assert(slots[1] == slots[0] + 2 && isSlot(slots[0]));
+    assert(getRun(slots[kRunSize / 16]) != getRun(slots[0]));
+    free(slots[7]);
+    assert(alloc(16) == slots[7]);
+    for (auto &slot : slots) free(slot);
+    assert(heap->emptyRuns == getRun(slots[0]));
+    assert(heap->partialRuns[1] == getRun(slots[kRunSize / 16]) && !heap->partialRuns[1]->next);
+    // a trim gives the page of the empty run back
+    heapTrim();
+    resident = 1;
+    assert(mincore(slots[0], kRunSize, &resident) == 0 && !(resident & 1));
+    assert(getRun(slots[0])->trimmed && !getRun(slots[kRunSize / 16])->trimmed);
+    assert(alloc(64) == slots[0] && getRun(slots[0])->slotSize == 64);
+
+    word_t *big = alloc(kBitmapLimit + 8);
+    assert(!isSlot(big) && getSize(getHeader(big)) == kBitmapLimit + 8);
+    free(big);
+
+    // realloc: grows into a free neighbour or the arena, shrinks by
+    // splitting, and moves large objects with mremap
+    init(SearchMode::SegregatedList);
+    word_t *r1 = alloc(32);
+    word_t *r2 = alloc(32);
+    word_t *r3 = alloc(32);
+    for (int i = 0; i < 4; ++i) r1[i] = i;
+    free(r2);
+    assert(reallocate(r1, 64) == r1 && getSize(getHeader(r1)) >= 64);
+    assert(r1[3] == 3 && nextBlock(getHeader(r1)) == getHeader(r3));
+    assert(reallocate(r1, 16) == r1 && getSize(getHeader(r1)) == minPayload());
+    Block *tail = nextBlock(getHeader(r1));
+    assert(!isUsed(tail) && nextBlock(tail) == getHeader(r3));
+    assert(reallocate(r3, 8192) == r3 && getSize(getHeader(r3)) == 8192);
+
+    word_t *r4 = reallocate(nullptr, 200 << 10);
+    for (size_t i = 0; i < (200 << 10) / sizeof(word_t); ++i) r4[i] = i;
+    r4 = reallocate(r4, 4 << 20);
+    assert(isMapped(getHeader(r4)) && getSize(getHeader(r4)) >= (4 << 20));
+    assert(r4[(200 << 10) / sizeof(word_t) - 1] == (200 << 10) / sizeof(word_t) - 1);
+    word_t *r5 = reallocate(r4, 64);
+    assert(!isMapped(getHeader(r5)) && r5[7] == 7);
+
+    // calloc: reused memory is cleared, fresh memory is zero already
+    memset(r5, 0xff, 64);
+    free(r5);
+    word_t *z = allocZeroed(8, sizeof(word_t));
+    assert(z == r5);
+    for (int i = 0; i < 8; ++i) assert(z[i] == 0);
+    assert(allocZeroed(SIZE_MAX / 2, 4) == nullptr);
+    free(z);
+    free(r1);
+    free(r3);
+
+    // aligned allocation: the gap in front becomes a free block, large
+    // alignments get mappings of their own
+    for (SearchMode mode : {SearchMode::FirstFit, SearchMode::BestFit, SearchMode::Bitmap}) {
+        init(mode);
+        word_t *pad = alloc(8);
+        for (size_t alignment : {16, 64, 256, 4096}) {
+            word_t *p = allocAligned(alignment, 100);
+            assert((uintptr_t)p % alignment == 0 && usableSize(p) >= 100);
+            if (!isSlot(p)) {
+                assert(getSize(getHeader(p)) < 100 + alignment + allocSize(minPayload()));
+                Block *prev = prevBlock(getHeader(p));
+                assert(prev == nullptr || getSize(prev) >= minPayload());
+            }
+            memset(p, 0xab, 100);
+            free(p);
+        }
+        free(pad);
+    }
+    init(SearchMode::Bitmap);
+    word_t *line = allocAligned(64, 40);
+    assert(isSlot(line) && (uintptr_t)line % 64 == 0 && usableSize(line) == 64);
+    free(line);
+
+    init(SearchMode::FirstFit);
+    size_t mappedBefore = heapMapped();
+    word_t *huge = allocAligned(2 << 20, 3 << 20);
+    assert((uintptr_t)huge % (2 << 20) == 0 && isMapped(getHeader(huge)));
+    assert(heapMapped() - mappedBefore <= (3 << 20) + 2 * pageSize());
+    huge[(3 << 20) / sizeof(word_t) - 1] = 1;
+    free(huge);
+    assert(heapMapped() == mappedBefore);
+
+    word_t *page = allocAligned(4096, 200 << 10);
+    assert((uintptr_t)page % 4096 == 0 && isMapped(getHeader(page)));
+    page[0] = 42;
+    page = reallocate(page, 1 << 20);
+    assert((uintptr_t)page % 4096 == 0 && page[0] == 42);
+    free(page);
+    assert(heapMapped() == mappedBefore);
+
+    // every payload is aligned to kMinAlign, whatever the mode and size
+    for (SearchMode mode : {SearchMode::FirstFit, SearchMode::BestFit,
+                            SearchMode::SegregatedList, SearchMode::Bitmap}) {
+        init(mode);
+        word_t *live[64];
+        for (size_t i = 0; i < 64; ++i) {
+            live[i] = alloc(i * 13 % 700);
+            assert((uintptr_t)live[i] % kMinAlign == 0);
+        }
+        for (size_t i = 0; i < 64; i += 3) free(live[i]);
+        for (size_t i = 0; i < 64; i += 3) {
+            live[i] = reallocate(alloc(i * 7 % 300), 2000 - i);
+            assert((uintptr_t)live[i] % kMinAlign == 0 && usableSize(live[i]) >= 2000 - i);
+        }
+        for (word_t *data : live) free(data);
+    }
+    word_t *small = alloc(8);
+    assert(alloc(SIZE_MAX) == nullptr && reallocate(small, SIZE_MAX - 8) == nullptr);
+    free(small);
+
+    // huge pages: arenas are 2 MiB aligned whether they come from the
+    // hugetlb pool or transparent huge pages, and fall back when neither works
+    heapHugePages(true);
+    init(SearchMode::SegregatedList);
+    word_t *onHuge = alloc(64 << 10);
+    if (heapStats().hugeBytes != 0) {
+        assert(heap->arena->huge && (uintptr_t)heap->arena % kHugePage == 0);
+        assert(heapStats().hugeBytes == heap->arena->size);
+    }
+    memset(onHuge, 1, 64 << 10);
+    free(onHuge);
+    heapHugePages(false);
+    init(SearchMode::SegregatedList);
+    assert(heapStats().hugeBytes == 0);
+    free(alloc(64));
+    assert(!heap->arena->huge);
+
+    // regions: a rewind hands everything after the mark out again,
+    // scopes nest, spare chunks are reused and released at the end
+    {
+        size_t mappedBefore = heapMapped();
+        Region region;
+        word_t *first = region.alloc(24);
+        Region::Mark mark = region.mark();
+        word_t *second = region.alloc(100);
+        assert(second >= first + 3 && (uintptr_t)second % alignof(max_align_t) == 0);
+        region.rewind(mark);
+        assert(region.alloc(100) == second);
+
+        // spill over several chunks, then refill the same chunks
+        std::vector<word_t *> spilled;
+        for (int i = 0; i < 1000; ++i) spilled.push_back(region.alloc(1000, 64));
+        for (word_t *data : spilled) assert((uintptr_t)data % 64 == 0);
+        size_t mappedSpilled = heapMapped();
+        region.rewind(mark);
+        region.alloc(100);
+        for (int i = 0; i < 1000; ++i) assert(region.alloc(1000, 64) == spilled[i]);
+        assert(heapMapped() == mappedSpilled);
+
+        word_t *large = region.alloc(1 << 20);
+        memset(large, 0, 1 << 20);
+        region.release();
+        assert(heapMapped() == mappedBefore);
+    }
+    {
+        RegionScope outer;
+        word_t *kept = threadRegion().alloc(32);
+        word_t *inner;
+        {
+            RegionScope scope;
+            inner = threadRegion().alloc(64);
+            assert(inner > kept);
+        }
+        assert(threadRegion().alloc(64) == inner);
+    }
+    // every thread bumps through a region of its own
+    std::vector<std::thread> handlers;
+    std::atomic<int> allocated{0};
+    for (int t = 0; t < 4; ++t) {
+        handlers.emplace_back([t, &allocated] {
+            RegionScope scope;
+            char *data = (char *)threadRegion().alloc(128);
+            memset(data, t, 128);
+            allocated++;
+            while (allocated < 4) std::this_thread::yield();
+            for (int i = 0; i < 128; ++i) assert(data[i] == t);
+        });
+    }
+    for (auto &handler : handlers) handler.join();
+
+    word_t *posix = nullptr;
+    assert(memAlign(&posix, 12, 8) == EINVAL && memAlign(&posix, 4, 8) == EINVAL);
+    assert(memAlign(&posix, 0, 8) == EINVAL);
+    assert(memAlign(&posix, 32, 8) == 0 && (uintptr_t)posix % 32 == 0);
+    free(posix);
+
+    // garbage collection, on a thread of its own: the frame of main is
+    // full of stale pointers into the heap from the tests above
+    init(SearchMode::SegregatedList);
+    std::thread(gcTests).join();
+};
 
-    
-};
\ No newline at end of file
+#endif
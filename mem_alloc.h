@@ -0,0 +1,199 @@
+/**
+ * @file mem_alloc.h
+ * @author ananya karra (ananya.karra@gmail.com)
+ * @brief interface of the generic memory allocator in mem_alloc.cpp,
+            for programs that link against it. build mem_alloc.cpp
+            with -DMEM_ALLOC_NO_MAIN to leave out its test main.
+ * @version 0.1
+ * @date 2025-01-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief machine word size. depending on the architecture can be 4 or 8 bytes.
+ */
+
+using word_t = intptr_t;
+
+/* Mode for seasrching a free block */
+enum class SearchMode {
+    FirstFit, NextFit, BestFit, FreeList, SegregatedList, Bitmap,
+};
+
+/* resets the heap and selects the search mode. a thread-safe heap puts
+   per-thread caches in front of per-CPU heap shards, each with its own
+   lock; a block freed from another shard is handed back to its owner. */
+void init(SearchMode mode, bool safe = false);
+
+// Allocates a block of memory of (at least) 'size' bytes.
+word_t *alloc(size_t size);
+
+/* Frees the previously allocated block. */
+void free(word_t *data);
+
+/* resizes the allocation, in place whenever possible. like C realloc,
+   a null pointer allocates and size 0 frees. */
+word_t *reallocate(word_t *data, size_t size);
+
+/* allocates 'count' zeroed objects of 'size' bytes (calloc) */
+word_t *allocZeroed(size_t count, size_t size);
+
+/* allocates 'size' bytes at a multiple of 'alignment', a power of two
+   (aligned_alloc). returns nullptr for any other alignment. */
+word_t *allocAligned(size_t alignment, size_t size);
+
+/* posix_memalign: stores the block in *data and returns 0, or EINVAL for
+   a bad alignment and ENOMEM when out of memory */
+int memAlign(word_t **data, size_t alignment, size_t size);
+
+/* bytes usable in the allocation, at least the requested size */
+size_t usableSize(word_t *data);
+
+/**
+ * @brief region (arena) allocator for memory that dies all at once, like
+ everything a request handler allocates. allocation bumps a pointer, there
+ is no per-object free: rewinding to a mark releases everything allocated
+ after it in O(1), and the memory is reused by the next allocations.
+ */
+
+struct Region {
+    struct Chunk;
+
+    /* position in the region to rewind to */
+    struct Mark {
+        Chunk *chunk;
+        char *top;
+    };
+
+    Region() = default;
+    Region(const Region &) = delete;
+    Region &operator=(const Region &) = delete;
+    ~Region();
+
+    /* allocates 'size' bytes at a multiple of 'alignment' (a power of two) */
+    word_t *alloc(size_t size, size_t alignment = alignof(max_align_t));
+    Mark mark() const;
+    /* frees everything allocated since the mark was taken */
+    void rewind(Mark mark);
+    /* frees everything and gives the memory back to the OS */
+    void release();
+
+private:
+    word_t *grow(size_t size, size_t alignment);
+
+    Chunk *first = nullptr;     // chunks, oldest first
+    Chunk *current = nullptr;   // chunk being filled, later ones are spare
+    char *top = nullptr;
+    char *end = nullptr;
+};
+
+/* the region of the calling thread, released when the thread exits */
+Region &threadRegion();
+
+/* rewinds the region to where it was when the scope was entered */
+struct RegionScope {
+    explicit RegionScope(Region &region = threadRegion())
+        : region(region), mark(region.mark()) {}
+    RegionScope(const RegionScope &) = delete;
+    ~RegionScope() { region.rewind(mark); }
+
+    Region &region;
+    Region::Mark mark;
+};
+
+/**
+ * @brief garbage-collected allocation. objects from gcAlloc() are zeroed,
+ must not be passed to free(), and are freed once no root reaches them.
+ * roots are the registered pointer variables and, conservatively, the
+ stack and registers of the thread running the collector. collected
+ objects belong to that one thread; other threads may use alloc/free on
+ the same heap meanwhile.
+ * the collector runs incrementally, in steps of bounded length started by
+ gcAlloc() itself. while a cycle runs, pointers must be stored into
+ collected objects through gcWrite().
+ */
+
+word_t *gcAlloc(size_t size);
+
+/* stores 'value' into a slot of a collected object (the write barrier) */
+void gcWrite(word_t **slot, word_t *value);
+
+/* registers a pointer variable whose object is always kept alive */
+void gcAddRoot(word_t **root);
+void gcRemoveRoot(word_t **root);
+
+/* runs one step of the collector, true when it finished a cycle */
+bool gcStep();
+
+/* runs a whole collection cycle now */
+void gcCollect();
+
+/* longest a single collector step may run, 500 us by default */
+void gcPauseBudget(uint64_t microseconds);
+
+/**
+ * @brief snapshot of the heap: bytes mapped from the OS, payload bytes in
+ used blocks (including blocks parked in thread caches or waiting for a
+ deferred free) and in free blocks, and the largest free payload.
+ */
+
+struct HeapUsage {
+    size_t mapped;
+    size_t used;
+    size_t free;
+    size_t largestFree;
+};
+
+/* bytes currently mapped from the OS, cheap enough to call per operation */
+size_t heapMapped();
+
+/* bytes the heap has grown to inside its arenas, plus large objects */
+size_t heapSize();
+
+/* backs the arenas mapped from now on with 2 MiB pages: the hugetlb pool
+   if it has room, else transparent huge pages, else normal pages. */
+void heapHugePages(bool enable);
+
+/* defers frees: freed blocks wait in a buffer and are coalesced in
+   address-sorted batches when it fills up or an allocation misses.
+   turning it off frees the waiting blocks. */
+void heapDeferFree(bool enable);
+
+/* gives the pages of large free blocks and empty bitmap runs back to the
+   OS right away. the heap also trims itself each time half of its size
+   has been freed. */
+void heapTrim();
+
+/* walks the heap to fill a HeapUsage */
+HeapUsage heapUsage();
+
+/**
+ * @brief allocator counters, kept per thread and summed when read.
+ * counts are totals since the start of the process, the byte and
+ fragmentation figures describe the heap right now.
+ */
+
+struct HeapStats {
+    uint64_t allocs, frees;
+    uint64_t searches;          // findBlock calls
+    uint64_t blocksSearched;    // blocks (or tree nodes, lists) looked at
+    uint64_t splits, coalesces;
+    uint64_t cacheHits;         // allocations served by a thread cache
+    uint64_t osRequests;        // arenas and large objects mapped
+    size_t mappedBytes;         // held from the OS
+    size_t hugeBytes;           // arenas on huge pages
+    size_t liveBytes;           // live blocks, headers included
+    double internalFrag;        // 1 - requested / allocated bytes, all allocations
+    double externalFrag;        // 1 - largest free / total free payload
+    uint64_t liveBySize[64];    // live blocks by log2 of their size
+};
+
+/* sums the counters of all threads, walks the heap for fragmentation */
+HeapStats heapStats();
@@ -0,0 +1,367 @@
+/**
+ * @file mem_alloc_bench.cpp
+ * @author ananya karra (ananya.karra@gmail.com)
+ * @brief benchmark for the allocator in mem_alloc.cpp. replays the same
+            allocation workloads against every search mode and reports
+            throughput, latency percentiles, peak heap size,
+            fragmentation and blocks searched per allocation.
+ * @version 0.1
+ * @date 2025-01-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+/* build:
+    g++ -O2 -std=c++20 -pthread -DMEM_ALLOC_NO_MAIN mem_alloc.cpp \
+        mem_alloc_bench.cpp -o mem_alloc_bench
+
+usage:
+    mem_alloc_bench [--ops N] [--trace file]... [--record prefix] [--huge] [--defer]
+
+--trace replays a recorded trace next to the synthetic workloads, --record
+writes the synthetic workloads out as <prefix>.<name>.trace, --huge puts
+the arenas on 2 MiB pages, --defer batches the frees. a trace holds
+one operation per line: "a <id> <size>" allocates object <id>, "f <id>"
+frees it. */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mem_alloc.h"
+
+/**
+ * @brief one operation of a workload: allocate 'size' bytes as object
+ 'id', or free object 'id'. ids are dense, so objects live in a vector.
+ */
+
+struct Op {
+    bool isFree;
+    uint32_t id;
+    uint32_t size;
+};
+
+struct Workload {
+    std::string name;
+    std::vector<Op> ops;
+    uint32_t objects;
+};
+
+/* hands out dense object ids and records the operations on them */
+struct Recorder {
+    Workload workload;
+    std::vector<uint32_t> unused;
+
+    uint32_t allocate(uint32_t size) {
+        uint32_t id = workload.objects;
+        if (!unused.empty()) {
+            id = unused.back();
+            unused.pop_back();
+        } else {
+            workload.objects++;
+        }
+        workload.ops.push_back({false, id, size});
+        return id;
+    }
+
+    void release(uint32_t id) {
+        workload.ops.push_back({true, id, 0});
+        unused.push_back(id);
+    }
+};
+
+// ----------------------------------------------------------------
+
+// Synthetic workloads
+
+constexpr int kSlots = 10000;
+
+/* random sizes in [8, 256], random object picked for replacement */
+Workload uniformSmall(size_t ops) {
+    Recorder rec{{"uniform", {}, 0}, {}};
+    std::mt19937 rng(1);
+    std::vector<int64_t> slots(kSlots, -1);
+    while (rec.workload.ops.size() < ops) {
+        auto &slot = slots[rng() % kSlots];
+        if (slot >= 0) rec.release(slot);
+        slot = rec.allocate(8 + rng() % 249);
+    }
+    for (auto slot : slots) if (slot >= 0) rec.release(slot);
+    return rec.workload;
+}
+
+/* mostly small objects, some medium ones and a tail of large buffers
+   (log-uniform sizes up to 256 KiB, so some go straight to mmap) */
+Workload mixedSizes(size_t ops) {
+    Recorder rec{{"mixed", {}, 0}, {}};
+    std::mt19937 rng(2);
+    std::vector<int64_t> slots(kSlots, -1);
+    auto size = [&rng]() -> uint32_t {
+        unsigned dice = rng() % 100;
+        if (dice < 70) return 16 + rng() % 49;
+        if (dice < 95) return 64 + rng() % 961;
+        double bits = 10 + (rng() % 1000) / 1000.0 * 8;
+        return (uint32_t)std::exp2(bits);
+    };
+    while (rec.workload.ops.size() < ops) {
+        auto &slot = slots[rng() % kSlots];
+        if (slot >= 0) rec.release(slot);
+        slot = rec.allocate(size());
+    }
+    for (auto slot : slots) if (slot >= 0) rec.release(slot);
+    return rec.workload;
+}
+
+/* producer/consumer: objects die in the order they were made, the
+   queue length wanders between 1000 and 9000 */
+Workload producerConsumer(size_t ops) {
+    Recorder rec{{"fifo", {}, 0}, {}};
+    std::mt19937 rng(3);
+    std::deque<uint32_t> queue;
+    size_t target = 5000;
+    while (rec.workload.ops.size() < ops) {
+        if (rng() % 1000 == 0) target = 1000 + rng() % 8000;
+        if (queue.size() < target || rng() % 2) {
+            queue.push_back(rec.allocate(32 + rng() % 481));
+        } else {
+            rec.release(queue.front());
+            queue.pop_front();
+        }
+    }
+    for (auto id : queue) rec.release(id);
+    return rec.workload;
+}
+
+/* long-lived objects interleaved with bursts of short-lived ones, the
+   pattern that leaves holes all over the heap */
+Workload longShort(size_t ops) {
+    Recorder rec{{"longshort", {}, 0}, {}};
+    std::mt19937 rng(4);
+    std::vector<uint32_t> longLived;
+    std::vector<uint32_t> burst;
+    while (rec.workload.ops.size() < ops) {
+        longLived.push_back(rec.allocate(16 + rng() % 113));
+        for (int i = 0; i < 10; ++i) burst.push_back(rec.allocate(64 + rng() % 1985));
+        if (burst.size() > 200) {
+            std::shuffle(burst.begin(), burst.end(), rng);
+            for (auto id : burst) rec.release(id);
+            burst.clear();
+        }
+        if (longLived.size() > 20000) {
+            for (size_t i = 0; i < longLived.size(); i += 2) rec.release(longLived[i]);
+            size_t kept = 0;
+            for (size_t i = 1; i < longLived.size(); i += 2) longLived[kept++] = longLived[i];
+            longLived.resize(kept);
+        }
+    }
+    for (auto id : burst) rec.release(id);
+    for (auto id : longLived) rec.release(id);
+    return rec.workload;
+}
+
+// ----------------------------------------------------------------
+
+// Recorded traces
+
+bool saveTrace(const Workload &workload, const std::string &path) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) return false;
+    for (const Op &op : workload.ops) {
+        if (op.isFree) fprintf(file, "f %u\n", op.id);
+        else fprintf(file, "a %u %u\n", op.id, op.size);
+    }
+    fclose(file);
+    return true;
+}
+
+/* reads a trace, renumbering its ids densely. frees of unknown objects
+   are dropped and objects still live at the end are freed. */
+bool loadTrace(const std::string &path, Workload &workload) {
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr) return false;
+
+    Recorder rec{{path, {}, 0}, {}};
+    std::unordered_map<uint64_t, uint32_t> live;
+    char kind;
+    unsigned long long id, size;
+    size_t skipped = 0;
+    while (fscanf(file, " %c %llu", &kind, &id) == 2) {
+        if (kind == 'a' && fscanf(file, " %llu", &size) == 1) {
+            if (live.count(id)) rec.release(live[id]);
+            live[id] = rec.allocate((uint32_t)size);
+        } else if (kind == 'f' && live.count(id)) {
+            rec.release(live[id]);
+            live.erase(id);
+        } else {
+            skipped++;
+        }
+    }
+    fclose(file);
+    for (auto &entry : live) rec.release(entry.second);
+
+    if (skipped) fprintf(stderr, "%s: skipped %zu operations\n", path.c_str(), skipped);
+    workload = rec.workload;
+    return true;
+}
+
+// ----------------------------------------------------------------
+
+// Replay
+
+struct Result {
+    double opsPerSec;
+    double p50, p99, p999;   // nanoseconds
+    size_t peakHeap;
+    double utilization;      // peak live bytes / peak heap size
+    double externalFrag;     // 1 - largest free / total free, averaged
+    double searched;         // blocks looked at per findBlock call
+};
+
+using Clock = std::chrono::steady_clock;
+
+inline void apply(const Op &op, std::vector<word_t *> &objects) {
+    if (op.isFree) {
+        free(objects[op.id]);
+        return;
+    }
+    word_t *data = alloc(op.size);
+    *data = op.id;
+    objects[op.id] = data;
+}
+
+Result replay(const Workload &workload, SearchMode mode) {
+    Result result = {};
+    std::vector<word_t *> objects(workload.objects);
+    const auto &ops = workload.ops;
+
+    // 1. throughput, nothing but the operations in the timed loop
+    init(mode);
+    auto start = Clock::now();
+    for (const Op &op : ops) apply(op, objects);
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    result.opsPerSec = ops.size() / elapsed.count();
+
+    // 2. latency of every operation and footprint along the way
+    init(mode);
+    HeapStats before = heapStats();
+    std::vector<uint32_t> latency(ops.size());
+    size_t live = 0, peakLive = 0;
+    size_t sampleEvery = std::max<size_t>(ops.size() / 16, 1);
+    int samples = 0;
+
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const Op &op = ops[i];
+        auto before = Clock::now();
+        apply(op, objects);
+        latency[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         Clock::now() - before).count();
+
+        if (op.isFree) live -= op.size;
+        else peakLive = std::max(peakLive, live += op.size);
+        result.peakHeap = std::max(result.peakHeap, heapSize());
+
+        if (i % sampleEvery == sampleEvery / 2) {
+            HeapUsage usage = heapUsage();
+            if (usage.free > 0) {
+                result.externalFrag += 1.0 - (double)usage.largestFree / usage.free;
+                samples++;
+            }
+        }
+    }
+    HeapStats after = heapStats();
+    init(mode);
+
+    if (after.searches > before.searches) {
+        result.searched = (double)(after.blocksSearched - before.blocksSearched) /
+                          (after.searches - before.searches);
+    }
+    if (samples) result.externalFrag /= samples;
+    if (result.peakHeap) result.utilization = (double)peakLive / result.peakHeap;
+    std::sort(latency.begin(), latency.end());
+    auto percentile = [&latency](double p) {
+        return (double)latency[std::min(latency.size() - 1, (size_t)(p * latency.size()))];
+    };
+    result.p50 = percentile(0.50);
+    result.p99 = percentile(0.99);
+    result.p999 = percentile(0.999);
+    return result;
+}
+
+/* sizes are only known at allocation, frees look them up here */
+void recordFreeSizes(Workload &workload) {
+    std::vector<uint32_t> sizes(workload.objects);
+    for (Op &op : workload.ops) {
+        if (op.isFree) op.size = sizes[op.id];
+        else sizes[op.id] = op.size;
+    }
+}
+
+// ----------------------------------------------------------------
+
+int main(int argc, char const *argv[]) {
+    size_t ops = 200000;
+    std::vector<std::string> traces;
+    std::string record;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--ops") && i + 1 < argc) ops = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc) traces.push_back(argv[++i]);
+        else if (!strcmp(argv[i], "--record") && i + 1 < argc) record = argv[++i];
+        else if (!strcmp(argv[i], "--huge")) heapHugePages(true);
+        else if (!strcmp(argv[i], "--defer")) heapDeferFree(true);
+        else {
+            fprintf(stderr, "usage: %s [--ops N] [--trace file]... [--record prefix] [--huge] [--defer]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<Workload> workloads = {
+        uniformSmall(ops), mixedSizes(ops), producerConsumer(ops), longShort(ops),
+    };
+    if (!record.empty()) {
+        for (const auto &workload : workloads) {
+            std::string path = record + "." + workload.name + ".trace";
+            if (!saveTrace(workload, path)) fprintf(stderr, "cannot write %s\n", path.c_str());
+        }
+    }
+    for (const auto &path : traces) {
+        Workload workload;
+        if (!loadTrace(path, workload)) {
+            fprintf(stderr, "cannot read %s\n", path.c_str());
+            return 1;
+        }
+        workloads.push_back(workload);
+    }
+
+    const std::pair<SearchMode, const char *> modes[] = {
+        {SearchMode::FirstFit, "FirstFit"},
+        {SearchMode::NextFit, "NextFit"},
+        {SearchMode::BestFit, "BestFit"},
+        {SearchMode::FreeList, "FreeList"},
+        {SearchMode::SegregatedList, "SegregatedList"},
+        {SearchMode::Bitmap, "Bitmap"},
+    };
+
+    printf("%-12s %-15s %12s %8s %8s %8s %11s %6s %9s %9s\n", "workload", "mode",
+           "ops/s", "p50 ns", "p99 ns", "p99.9 ns", "heap KiB", "util", "ext frag",
+           "searched");
+    for (auto &workload : workloads) {
+        recordFreeSizes(workload);
+        for (const auto &[mode, name] : modes) {
+            Result r = replay(workload, mode);
+            printf("%-12s %-15s %12.0f %8.0f %8.0f %8.0f %11zu %5.1f%% %8.1f%% %9.1f\n",
+                   workload.name.c_str(), name, r.opsPerSec, r.p50, r.p99, r.p999,
+                   r.peakHeap >> 10, 100 * r.utilization, 100 * r.externalFrag,
+                   r.searched);
+            fflush(stdout);
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/**
+ * @file mem_alloc_preload.cpp
+ * @author ananya karra (ananya.karra@gmail.com)
+ * @brief the custom heap as the malloc of any program, interposed at load
+            time like cimpl/interpose_mymalloc.c does with RTLD_NEXT, but
+            without ever calling into libc malloc.
+ * build and run:
+ *   g++ -O2 -std=c++20 -shared -fPIC -pthread -DMEM_ALLOC_NO_MAIN \
+ *       -DMEM_ALLOC_MIN_ALIGN=16 mem_alloc.cpp mem_alloc_preload.cpp \
+ *       -o libmem_alloc.so
+ *   LD_PRELOAD=./libmem_alloc.so ls -l
+ * @version 0.1
+ * @date 2025-01-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <malloc.h>
+#include <unistd.h>
+#include "mem_alloc.h"
+
+/* the heap is set up by the first call, which comes from the dynamic
+   loader or a library constructor, long before main and before any other
+   thread exists. bitmap runs serve small objects, thread caches keep the
+   common paths off the heap lock, and no mode is used whose free list
+   would itself call malloc. */
+static bool ready = false;
+
+inline void setup() {
+    if (ready) return;
+    ready = true;
+    init(SearchMode::Bitmap, true);
+}
+
+/* glibc sets errno when it runs out of memory, so do we */
+inline void *checked(word_t *data) {
+    if (data == nullptr) errno = ENOMEM;
+    return data;
+}
+
+extern "C" {
+
+void *malloc(size_t size) noexcept {
+    setup();
+    return checked(alloc(size));
+}
+
+void free(void *ptr) noexcept {
+    if (ptr == nullptr) return;
+    free((word_t *)ptr);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+    setup();
+    return checked(allocZeroed(count, size));
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+    setup();
+    word_t *data = reallocate((word_t *)ptr, size);
+    if (data == nullptr && size != 0) errno = ENOMEM;
+    return data;
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) noexcept {
+    setup();
+    return memAlign((word_t **)ptr, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+    setup();
+    word_t *data = allocAligned(alignment, size);
+    if (data == nullptr) errno = alignment == 0 || (alignment & (alignment - 1)) ? EINVAL : ENOMEM;
+    return data;
+}
+
+/* the obsolete entry points, or the program would mix them with ours */
+void *memalign(size_t alignment, size_t size) noexcept {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) noexcept {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) noexcept {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) noexcept {
+    return ptr == nullptr ? 0 : usableSize((word_t *)ptr);
+}
+
+}
@@ -1,74 +1,242 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <cassert>
 #include <cstddef>
 #include <pthread.h>
 
-#define object_count 16
+#define object_count 1024
 #define thread_count 4
+// free indices a magazine holds. threads lock the pool only to trade a
+// whole magazine, so about once per magazine_size operations
+#define magazine_size 32
+// pools a thread keeps magazines for at the same time
+#define cache_slots 4
 
 struct entity {
     int health;
 };
 
+/* a stack of free indices, held by one thread or parked in the depot */
+struct magazine {
+    struct magazine* next;
+    int count;
+    int indices[magazine_size];
+};
 
 struct pool {
     void* memory;
     size_t object_size;
-    int free_indices[object_count];
-    int free_top;
+    // the depot, shared by all threads: magazines with free indices and
+    // empty ones, guarded by the mutex
+    struct magazine* full;
+    struct magazine* empty;
+    long depot_visits;
     pthread_mutex_t mutex;
 };
 
+/* the magazines a thread holds for one pool. allocations pop from
+   'loaded'; when it runs dry the thread tries 'previous' before the
+   depot, so going back and forth across a magazine boundary never
+   touches the lock. */
+struct magazine_cache {
+    struct pool* pool;
+    struct magazine* loaded;
+    struct magazine* previous;
+};
+
+struct thread_caches {
+    struct magazine_cache slots[cache_slots];
+    ~thread_caches();
+};
+
+static thread_local struct thread_caches caches;
+
+static struct magazine* magazine_new(void) {
+    struct magazine* magazine = (struct magazine*)calloc(1, sizeof(struct magazine));
+    assert(magazine != NULL);
+    return magazine;
+}
+
 static void pool_init(struct pool* pool, size_t object_size) {
     pool->memory = malloc(object_count * object_size);
     pool->object_size = object_size;
-    for (int i = 0; i < object_count; i++) {
-        pool->free_indices[i] = i;
+    pool->full = NULL;
+    pool->empty = NULL;
+    pool->depot_visits = 0;
+    // every index starts out in a magazine of the depot
+    for (int i = object_count - 1; i >= 0;) {
+        struct magazine* magazine = magazine_new();
+        while (magazine->count < magazine_size && i >= 0) {
+            magazine->indices[magazine->count++] = i--;
+        }
+        magazine->next = pool->full;
+        pool->full = magazine;
     }
-    pool->free_top = object_count - 1;
     pthread_mutex_init(&pool->mutex, NULL);
-};
+}
+
+/* the calling thread's magazines for the pool, set up on first use */
+static struct magazine_cache* cache_for(struct pool* pool) {
+    struct magazine_cache* unused = NULL;
+    for (int i = 0; i < cache_slots; i++) {
+        if (caches.slots[i].pool == pool) return &caches.slots[i];
+        if (caches.slots[i].pool == NULL && unused == NULL) unused = &caches.slots[i];
+    }
+    assert(unused != NULL && "a thread uses at most cache_slots pools");
+    unused->pool = pool;
+    unused->loaded = magazine_new();
+    unused->previous = magazine_new();
+    return unused;
+}
 
 static void* pool_alloc(struct pool* pool) {
-    pthread_mutex_lock(&pool->mutex);
-    void* result = NULL;
-    if (pool->free_top >=  0) {
-        int index = pool->free_indices[pool->free_top--];
-        // return std::nullptr_t(nullptr);
-        // object_size = 16
-        // 0 
-        result = (char*)pool->memory + index*pool->object_size;
+    struct magazine_cache* cache = cache_for(pool);
+    if (cache->loaded->count == 0) {
+        struct magazine* dry = cache->loaded;
+        if (cache->previous->count > 0) {
+            cache->loaded = cache->previous;
+            cache->previous = dry;
+        } else {
+            // both are empty: trade one for a full magazine of the depot
+            pthread_mutex_lock(&pool->mutex);
+            pool->depot_visits++;
+            struct magazine* full = pool->full;
+            if (full != NULL) {
+                pool->full = full->next;
+                cache->previous->next = pool->empty;
+                pool->empty = cache->previous;
+                cache->previous = dry;
+                cache->loaded = full;
+            }
+            pthread_mutex_unlock(&pool->mutex);
+            // other threads may still hold up to two magazines each
+            if (full == NULL) return NULL;
+        }
     }
-    pthread_mutex_unlock(&pool->mutex);
-    return result;
-};
+    struct magazine* magazine = cache->loaded;
+    int index = magazine->indices[--magazine->count];
+    return (char*)pool->memory + index * pool->object_size;
+}
 
 void pool_dealloc(struct pool* pool, struct entity* entity) {
-    int index = ((ptrdiff_t)entity - (ptrdiff_t)pool->memory) 
+    struct magazine_cache* cache = cache_for(pool);
+    int index = ((ptrdiff_t)entity - (ptrdiff_t)pool->memory)
     / pool->object_size;
-    pool->free_indices[++pool->free_top] = index;
-    pthread_mutex_unlock(&pool->mutex);
-};
+    if (cache->loaded->count == magazine_size) {
+        struct magazine* filled = cache->loaded;
+        if (cache->previous->count < magazine_size) {
+            cache->loaded = cache->previous;
+            cache->previous = filled;
+        } else {
+            // both are full: trade one for an empty magazine
+            pthread_mutex_lock(&pool->mutex);
+            pool->depot_visits++;
+            struct magazine* empty = pool->empty;
+            if (empty != NULL) pool->empty = empty->next;
+            cache->previous->next = pool->full;
+            pool->full = cache->previous;
+            pthread_mutex_unlock(&pool->mutex);
+            cache->previous = filled;
+            cache->loaded = empty != NULL ? empty : magazine_new();
+            cache->loaded->count = 0;
+        }
+    }
+    struct magazine* magazine = cache->loaded;
+    magazine->indices[magazine->count++] = index;
+}
 
-// 0 1 2 3
-// 3* 2* 1* 0*
-// 3 2 1 0
+/* hands the calling thread's magazines of the pool back to the depot.
+   threads do this by themselves when they exit. */
+static void pool_flush(struct pool* pool) {
+    for (int i = 0; i < cache_slots; i++) {
+        struct magazine_cache* cache = &caches.slots[i];
+        if (cache->pool != pool) continue;
+        pthread_mutex_lock(&pool->mutex);
+        struct magazine* held_magazines[2] = {cache->loaded, cache->previous};
+        for (struct magazine* magazine : held_magazines) {
+            struct magazine** depot = magazine->count > 0 ? &pool->full : &pool->empty;
+            magazine->next = *depot;
+            *depot = magazine;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        cache->pool = NULL;
+    }
+}
+
+thread_caches::~thread_caches() {
+    for (int i = 0; i < cache_slots; i++) {
+        if (slots[i].pool != NULL) pool_flush(slots[i].pool);
+    }
+}
+
+/* frees the pool. other threads must have flushed or exited. */
+static void pool_destroy(struct pool* pool) {
+    pool_flush(pool);
+    struct magazine* lists[2] = {pool->full, pool->empty};
+    for (struct magazine* list : lists) {
+        while (list != NULL) {
+            struct magazine* next = list->next;
+            free(list);
+            list = next;
+        }
+    }
+    free(pool->memory);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+/* free indices parked in the depot */
+static int depot_count(struct pool* pool) {
+    int count = 0;
+    for (struct magazine* magazine = pool->full; magazine != NULL; magazine = magazine->next) {
+        count += magazine->count;
+    }
+    return count;
+}
 
 void pool_test_single_threaded(void) {
     struct pool pool;
     pool_init(&pool, sizeof(struct entity));
     struct entity* entities[object_count];
-    for (int i = 0; i < object_count; i++) { 
-        pool_dealloc(&pool, entities[i]);
+    bool taken[object_count] = {};
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < object_count; i++) {
+            entities[i] = (struct entity*)pool_alloc(&pool);
+            int index = entities[i] - (struct entity*)pool.memory;
+            assert(index >= 0 && index < object_count && !taken[index]);
+            taken[index] = true;
+        }
+        assert(pool_alloc(&pool) == NULL);
+        for (int i = 0; i < object_count; i++) {
+            pool_dealloc(&pool, entities[i]);
+            taken[entities[i] - (struct entity*)pool.memory] = false;
+        }
     }
-    for (int i = 0; i < object_count; i++) {
-        assert(pool.free_indices[i] == object_count - i - 1);
-    }
-};
+    // the depot is only visited once per magazine
+    assert(pool.depot_visits <= 4 * object_count / magazine_size + 2);
+    pool_flush(&pool);
+    assert(depot_count(&pool) == object_count);
+    pool_destroy(&pool);
+}
+
+#define rounds 100000
+#define held 16
 
 static void* thread_func(void* args) {
     struct pool* pool = (struct pool*)args;
-    pool_alloc(pool);
+    struct entity* entities[held];
+    int marker = (int)(ptrdiff_t)pthread_self();
+    for (int round = 0; round < rounds; round++) {
+        int count = 1 + round % held;
+        for (int i = 0; i < count; i++) {
+            entities[i] = (struct entity*)pool_alloc(pool);
+            assert(entities[i] != NULL);
+            entities[i]->health = marker + i;
+        }
+        for (int i = 0; i < count; i++) {
+            assert(entities[i]->health == marker + i);
+            pool_dealloc(pool, entities[i]);
+        }
+    }
     return NULL;
 }
 
@@ -76,7 +244,6 @@ int main(void) {
     pool_test_single_threaded();
     struct pool pool;
     pool_init(&pool, sizeof(struct entity));
-    // printf("free_top: %p\n", &pool.free_top);
     pthread_t threads[thread_count];
     for (int i = 0; i < thread_count; i++) {
         pthread_create(&threads[i], NULL, thread_func, &pool);
@@ -85,5 +252,11 @@ int main(void) {
     for (int i = 0; i < thread_count; i++) {
         pthread_join(threads[i], NULL);
     }
+    // exited threads gave their magazines back, and the lock was taken
+    // a tiny fraction of the time
+    long operations = 2L * thread_count * rounds * (held + 1) / 2;
+    printf("%ld operations, %ld depot visits\n", operations, pool.depot_visits);
+    assert(depot_count(&pool) == object_count);
+    assert(pool.depot_visits * 100 < operations);
+    pool_destroy(&pool);
 }
-
@@ -24,12 +24,41 @@
  * when allocated, space is used by the user.
  */
 
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <utility>
+#include <vector>
 struct chunk {
     chunk * next;
 };
 
+/* head of a block, in front of its chunks: blocks are chained so the
+   pool knows every block it got from the OS. pops and pushes count the
+   block's chunks on the free stack, trim() looks only at the blocks
+   where they are all free. */
+struct block {
+    block *next;
+    std::atomic<uint32_t> freeChunks;
+    // trim's own: whether the block may go, and its chunks it took off
+    // the free stack
+    bool candidate;
+    uint32_t taken;
+    chunk *takenFirst, *takenLast;
+};
+
+// blocks are mapped from the OS in pages, chunks can be padded to lines
+constexpr size_t kPageSize = 4096;
+constexpr size_t kCacheLine = 64;
+
 // NOTE: allocation pointer can directly handle next free chunk,
 //         we don't need track of the space taken by next pointer
 
@@ -37,50 +66,194 @@ struct chunk {
 /**
  * @brief allocator class
  * features:
-    * parameterized by # of chunks per block
+    * parameterized by the type of its chunks and # of chunks per block
+    * chunk size and alignment are known at compile time
     * keeps track of allocation pointer
     * bump-allocates chunks
-    * requests a new larger block when needed
+    * requests a new larger block when needed, mapped straight from the
+      OS and optionally prefaulted
+    * optionally pads chunks to whole cache lines (CacheAligned)
+    * thread-safe without a lock: the free chunks are a lock-free stack
+    * gives blocks whose chunks are all free back to the OS on trim()
  */
 
-
+template <typename T, size_t ChunksPerBlock = 64, bool CacheAligned = false>
 class PoolAllocator {
     public:
-    PoolAllocator(size_t chunksPerBlock) : mChunksPerBlock(chunksPerBlock) {}
-    void *allocate(size_t size);
-    void deallocate(void *ptr, size_t size);
-    
+    static_assert(ChunksPerBlock > 0, "a block holds at least one chunk");
+    static_assert(alignof(T) <= kPageSize, "blocks are only page aligned");
+
+    /* a free chunk holds the next pointer, a used one a T. cache-aligned
+       chunks start on a cache line and never share one */
+    static constexpr size_t chunkAlign = std::max({alignof(T), alignof(chunk),
+                                                   CacheAligned ? kCacheLine : 1});
+    static constexpr size_t chunkSize =
+        ((sizeof(T) > sizeof(chunk) ? sizeof(T) : sizeof(chunk)) + chunkAlign - 1) / chunkAlign * chunkAlign;
+    // the head keeps the chunks after it aligned
+    static constexpr size_t blockHead = (sizeof(block) + chunkAlign - 1) / chunkAlign * chunkAlign;
+    // blocks are whole pages, the chunks fill them: at least ChunksPerBlock
+    static constexpr size_t mapSize =
+        (blockHead + ChunksPerBlock * chunkSize + kPageSize - 1) / kPageSize * kPageSize;
+    static constexpr size_t chunksPerBlock = (mapSize - blockHead) / chunkSize;
+    static constexpr size_t blockSize = chunksPerBlock * chunkSize;
+    // blocks are mapped on this alignment, a chunk masks its address to
+    // find its block
+    static constexpr size_t blockAlign = std::bit_ceil(mapSize);
+
+    PoolAllocator() = default;
+    /* unmaps every block, chunks still in use go with them */
+    ~PoolAllocator();
+
+    T *allocate();
+    void deallocate(T *ptr);
+
+    /* allocates 'n' chunks into out[0..n) and frees them again, each in
+       one or two operations on the free stack */
+    void allocateBatch(T **out, size_t n);
+    void deallocateBatch(T **ptrs, size_t n);
+
+    /* gives the pages of the blocks whose chunks are all free back to
+       the OS, returns the bytes given back. the blocks keep their address
+       range and are reused before new ones are mapped. */
+    size_t trim();
+
+    /* trims the pool whenever a free leaves more than 'chunks' chunks
+       free, and twice as many as the last trim kept, 0 turns it off.
+       while it is on, every allocation and free also updates one shared
+       count of free chunks, a contended line next to the free stack. */
+    void trimAbove(size_t chunks) {
+        mFreeChunks = freeChunks();
+        mHighWatermark = chunks;
+    }
+
+    /* maps new blocks with their pages already backed (MAP_POPULATE),
+       so first touches of the chunks never page fault */
+    void prefault(bool enable) { mPrefault = enable; }
+
+    /* chunks currently free, in all blocks. sums the blocks' counts, and
+       misses the blocks a running trim holds */
+    size_t freeChunks() const;
+
     private:
-    size_t mChunksPerBlock;
+    /* allocation pointer, the top of a Treiber stack of free chunks. the
+       top 16 bits of the word count the changes to it: a pop that read a
+       top chunk which was popped and pushed back since (ABA) fails its
+       CAS instead of installing a stale next pointer. */
+    std::atomic<uintptr_t> mAlloc{0};
+
+    /* every block of the pool, newest first */
+    std::atomic<block *> mBlocks{nullptr};
+
+    // free chunks, counted only while the watermark is on. pops count
+    // after their CAS, so it can dip below 0 for a moment
+    std::atomic<ptrdiff_t> mFreeChunks{0};
+    std::atomic<size_t> mHighWatermark{0};
+    // free chunks the next watermark trim waits for: twice what the last
+    // one kept, so frees past the watermark don't trim over and over
+    std::atomic<size_t> mTrimAt{0};
+    std::atomic<bool> mPrefault{false};
+
+    /* blocks trim() gave the pages of back. a pop may still read the next
+       pointer of a chunk trim took off the stack, so their ranges stay
+       mapped (reading zeros) until a new block reuses them. */
+    std::vector<block *> mSpareBlocks;
+    std::mutex mTrimLock;
+
+    /* adds 'n' to the watermark's count of free chunks, returns the new
+       count, 0 while the watermark is off */
+    ptrdiff_t countFree(ptrdiff_t n);
+
+    /* trims when 'spare' free chunks passed the watermark and could fill
+       a block */
+    void trimIfAbove(ptrdiff_t spare);
+
+    // chunks trim() pushes back at once: allocations running meanwhile
+    // find the stack refilled soon, instead of mapping blocks of their own
+    static constexpr size_t kTrimBatch = 64;
+
+    static block *blockOf(chunk *c) {
+        return reinterpret_cast<block *>(reinterpret_cast<uintptr_t>(c) & ~(blockAlign - 1));
+    }
+
+    static_assert(sizeof(void *) == 8, "the tag lives above 48-bit addresses");
+    static constexpr int kTagShift = 48;
+    static constexpr uintptr_t kPointerMask = ((uintptr_t)1 << kTagShift) - 1;
+
+    static chunk *pointer(uintptr_t tagged) {
+        return reinterpret_cast<chunk *>(tagged & kPointerMask);
+    }
+
+    /* the next value of the allocation pointer: 'top' with the tag bumped */
+    static uintptr_t retag(uintptr_t tagged, chunk *top) {
+        return (((tagged >> kTagShift) + 1) << kTagShift) | reinterpret_cast<uintptr_t>(top);
+    }
+
+    /* the next pointer of a chunk another thread may have taken and be
+       writing to: the value is only used if the CAS shows it was still free */
+    __attribute__((no_sanitize("thread"))) static chunk *nextOf(chunk *c) {
+        return __atomic_load_n(&c->next, __ATOMIC_RELAXED);
+    }
 
-    /* allocation pointer */
-    chunk *mAlloc = nullptr;
+    /* pushes the chain first..last onto the free chunks with one CAS */
+    void push(chunk *first, chunk *last);
 
     /* allocates a larger block (pool) for chunks */
-    chunk *allocateBlock(size_t size);
+    chunk *allocateBlock();
 };
 
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+PoolAllocator<T, ChunksPerBlock, CacheAligned>::~PoolAllocator() {
+    for (block *b = mBlocks.load(std::memory_order_acquire), *next; b != nullptr; b = next) {
+        next = b->next;
+        munmap(b, mapSize);
+    }
+    for (block *spare : mSpareBlocks) munmap(spare, mapSize);
+}
+
 /**
  * @brief allocates a new block from Operating System.
  * 
  * Returns a chunk pointer set to the beginning of the block
  */
 
-chunk *PoolAllocator::allocateBlock(size_t chunkSize) {
-    size_t blockSize = mChunksPerBlock * chunkSize;
-
-    // first chunk allocation
-    chunk *blockBegin = reinterpret_cast<chunk *>(malloc(blockSize));
-
-    // once block has beena allocated, chain all chunks in this block
-    chunk *_chunk = blockBegin;
-
-    for (int i = 0; i < mChunksPerBlock - 1; ++i) {
-        _chunk->next = reinterpret_cast<chunk *>(reinterpret_cast<chunk *>(_chunk) + chunkSize);
-        _chunk = _chunk->next;
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+chunk *PoolAllocator<T, ChunksPerBlock, CacheAligned>::allocateBlock() {
+    // first chunk allocation. the mapping is aligned to blockAlign, the
+    // first chunk after the head to chunkAlign
+    char *mem = nullptr;
+    {
+        // a spare block, unless a trim is running: then map a new one
+        std::unique_lock<std::mutex> guard(mTrimLock, std::try_to_lock);
+        if (guard.owns_lock() && !mSpareBlocks.empty()) {
+            mem = reinterpret_cast<char *>(mSpareBlocks.back());
+            mSpareBlocks.pop_back();
+        }
+    }
+    if (mem == nullptr) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (mPrefault.load(std::memory_order_relaxed)) flags |= MAP_POPULATE;
+        // over-map by the alignment and cut off the ends around the block
+        size_t over = blockAlign - kPageSize;
+        void *mapped = mmap(nullptr, mapSize + over, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mapped == MAP_FAILED) return nullptr;
+        char *start = static_cast<char *>(mapped);
+        mem = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(start) + blockAlign - 1) & ~(blockAlign - 1));
+        if (mem != start) munmap(start, mem - start);
+        if (mem + mapSize != start + mapSize + over) munmap(mem + mapSize, start + over - mem);
+    }
+    block *head = new (mem) block{};
+    head->next = mBlocks.load(std::memory_order_relaxed);
+    while (!mBlocks.compare_exchange_weak(head->next, head, std::memory_order_relaxed)) {}
+    char *blockBegin = mem + blockHead;
+
+    // once block has been allocated, chain all chunks in this block.
+    // chunks are chunkSize bytes apart, so step in bytes
+    for (size_t i = 0; i < chunksPerBlock - 1; ++i) {
+        reinterpret_cast<chunk *>(blockBegin + i * chunkSize)->next =
+            reinterpret_cast<chunk *>(blockBegin + (i + 1) * chunkSize);
     }
-    _chunk->next = nullptr;
-    return blockBegin;
+    reinterpret_cast<chunk *>(blockBegin + (chunksPerBlock - 1) * chunkSize)->next = nullptr;
+    return reinterpret_cast<chunk *>(blockBegin);
 }
 
 /* free the current position of the allocation pointer mAlloc, advance, bump the 
@@ -89,14 +262,39 @@ allocation pointer further for future allocation requests.
 with chunk allocation, we return a free chunk at the current position of allocation
 pointer mAlloc. Advance (nump) the allocation pointer further for future allocation. */
 
-void *PoolAllocator::allocate(size_t size) {
-    if (mAlloc == nullptr) {
-        chunk* malloc = allocateBlock(size);
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+T *PoolAllocator<T, ChunksPerBlock, CacheAligned>::allocate() {
+    uintptr_t head = mAlloc.load(std::memory_order_acquire);
+    while (chunk *freeChunk = pointer(head)) {
+        if (mAlloc.compare_exchange_weak(head, retag(head, nextOf(freeChunk)),
+                                         std::memory_order_acquire, std::memory_order_acquire)) {
+            blockOf(freeChunk)->freeChunks.fetch_sub(1, std::memory_order_relaxed);
+            countFree(-1);
+            return reinterpret_cast<T *>(freeChunk);
+        }
     }
-    chunk *freeChunk = mAlloc;
-    mAlloc = mAlloc->next;
-    return freeChunk;
-}; // (bump-allocate) chunks within a block and malloc-allocate blocks from os
+
+    // no free chunk: this thread adds a block of its own without waiting
+    // for anyone, keeps the first chunk and publishes the rest at once
+    chunk *blockBegin = allocateBlock();
+    if (blockBegin == nullptr) throw std::bad_alloc();
+    if (chunksPerBlock > 1) {
+        char *last = reinterpret_cast<char *>(blockBegin) + (chunksPerBlock - 1) * chunkSize;
+        blockOf(blockBegin)->freeChunks.store(chunksPerBlock - 1, std::memory_order_relaxed);
+        push(blockBegin->next, reinterpret_cast<chunk *>(last));
+        countFree(chunksPerBlock - 1);
+    }
+    return reinterpret_cast<T *>(blockBegin);
+} // (bump-allocate) chunks within a block and mmap-allocate blocks from os
+
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+void PoolAllocator<T, ChunksPerBlock, CacheAligned>::push(chunk *first, chunk *last) {
+    uintptr_t head = mAlloc.load(std::memory_order_relaxed);
+    do {
+        last->next = pointer(head);
+    } while (!mAlloc.compare_exchange_weak(head, retag(head, first),
+                                           std::memory_order_release, std::memory_order_relaxed));
+}
 
 
 /**
@@ -105,13 +303,231 @@ void *PoolAllocator::allocate(size_t size) {
  // Place the chunk into the front of the chunks list.
  */
 
-void PoolAllocator::deallocate(void *chunk_, size_t size) {
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+void PoolAllocator<T, ChunksPerBlock, CacheAligned>::deallocate(T *ptr) {
+
+    // freed chunk's next pointer points to the current alloc pointer, and
+    // allocation pointer is now set to the returned (free) chunk
+    chunk *freed = reinterpret_cast<chunk *>(ptr);
+    blockOf(freed)->freeChunks.fetch_add(1, std::memory_order_relaxed);
+    push(freed, freed);
+
+    trimIfAbove(countFree(1));
+}
+
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+ptrdiff_t PoolAllocator<T, ChunksPerBlock, CacheAligned>::countFree(ptrdiff_t n) {
+    if (mHighWatermark.load(std::memory_order_relaxed) == 0) return 0;
+    return mFreeChunks.fetch_add(n, std::memory_order_relaxed) + n;
+}
 
-    // freed chunk's next pointer points to the current alloc pointer
-    reinterpret_cast<chunk *>(chunk_)->next = mAlloc;
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+void PoolAllocator<T, ChunksPerBlock, CacheAligned>::trimIfAbove(ptrdiff_t spare) {
+    size_t watermark = mHighWatermark.load(std::memory_order_relaxed);
+    if (watermark == 0 || spare < (ptrdiff_t)chunksPerBlock) return;
+    if ((size_t)spare > std::max(watermark, mTrimAt.load(std::memory_order_relaxed))) trim();
+}
+
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+size_t PoolAllocator<T, ChunksPerBlock, CacheAligned>::freeChunks() const {
+    size_t free = 0;
+    for (block *b = mBlocks.load(std::memory_order_acquire); b != nullptr; b = b->next)
+        free += b->freeChunks.load(std::memory_order_relaxed);
+    return free;
+}
+
+
+/**
+ * @brief batches take the whole free stack with one CAS, cut the chunks
+ they need off its front and put the rest back with another. what the
+ stack cannot give is carved from fresh blocks, whose chunks are
+ contiguous and need no list walk. single allocations running meanwhile
+ see an empty stack and add a block of their own.
+ */
+
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+void PoolAllocator<T, ChunksPerBlock, CacheAligned>::allocateBatch(T **out, size_t n) {
+    size_t got = 0;
+    uintptr_t head = mAlloc.load();
+    while (pointer(head) != nullptr &&
+           !mAlloc.compare_exchange_weak(head, retag(head, nullptr), std::memory_order_acquire)) {}
+
+    chunk *rest = pointer(head);
+    for (; rest != nullptr && got < n; rest = rest->next) {
+        blockOf(rest)->freeChunks.fetch_sub(1, std::memory_order_relaxed);
+        out[got++] = reinterpret_cast<T *>(rest);
+    }
+    if (rest != nullptr) {
+        // the rest goes back as it is, unless frees refilled the stack meanwhile
+        uintptr_t empty = mAlloc.load(std::memory_order_relaxed);
+        if (pointer(empty) != nullptr ||
+            !mAlloc.compare_exchange_strong(empty, retag(empty, rest), std::memory_order_release)) {
+            chunk *last = rest;
+            while (last->next != nullptr) last = last->next;
+            push(rest, last);
+        }
+    }
+    countFree(-(ptrdiff_t)got);
+
+    while (got < n) {
+        char *blockBegin = reinterpret_cast<char *>(allocateBlock());
+        if (blockBegin == nullptr) {
+            deallocateBatch(out, got);
+            throw std::bad_alloc();
+        }
+        size_t take = std::min(n - got, chunksPerBlock);
+        for (size_t i = 0; i < take; ++i) out[got++] = reinterpret_cast<T *>(blockBegin + i * chunkSize);
+        if (take < chunksPerBlock) {
+            blockOf(reinterpret_cast<chunk *>(blockBegin))->freeChunks.store(chunksPerBlock - take,
+                                                                             std::memory_order_relaxed);
+            push(reinterpret_cast<chunk *>(blockBegin + take * chunkSize),
+                 reinterpret_cast<chunk *>(blockBegin + (chunksPerBlock - 1) * chunkSize));
+            countFree(chunksPerBlock - take);
+        }
+    }
+}
+
+/* chains the chunks through their next pointers and pushes the chain */
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+void PoolAllocator<T, ChunksPerBlock, CacheAligned>::deallocateBatch(T **ptrs, size_t n) {
+    if (n == 0) return;
+    for (size_t i = 0; i < n; ++i) {
+        chunk *freed = reinterpret_cast<chunk *>(ptrs[i]);
+        blockOf(freed)->freeChunks.fetch_add(1, std::memory_order_relaxed);
+        freed->next = i + 1 < n ? reinterpret_cast<chunk *>(ptrs[i + 1]) : nullptr;
+    }
+    push(reinterpret_cast<chunk *>(ptrs[0]), reinterpret_cast<chunk *>(ptrs[n - 1]));
+
+    trimIfAbove(countFree(n));
+}
+
+
+/**
+ * @brief occupancy of the blocks is counted in their heads: trim picks
+ the blocks whose chunks all look free, takes the free stack and keeps
+ their chunks apart, pushing the others back in batches as it goes. a
+ block whose chunks were all on the stack gives its pages back, the
+ chunks of the others go back too.
+ * the counts change just before a push and just after a pop, so a block
+ can look free while a chunk is still being popped: the chunks found on
+ the stack have the final word. only one trim runs at a time. a pop that
+ read a taken chunk before may still read its next pointer: the pages
+ read zeros then, and the CAS fails on the new tag.
+ */
+
+template <typename T, size_t ChunksPerBlock, bool CacheAligned>
+size_t PoolAllocator<T, ChunksPerBlock, CacheAligned>::trim() {
+    std::unique_lock<std::mutex> guard(mTrimLock, std::try_to_lock);
+    if (!guard.owns_lock()) return 0;
+
+    block *blocks = mBlocks.exchange(nullptr, std::memory_order_acquire);
+    block *lastBlock = nullptr;
+    size_t free = 0, candidates = 0;
+    for (block *b = blocks; b != nullptr; b = b->next) {
+        size_t n = b->freeChunks.load(std::memory_order_relaxed);
+        free += n;
+        b->candidate = n == chunksPerBlock;
+        candidates += b->candidate;
+        lastBlock = b;
+    }
+
+    size_t released = 0;
+    if (candidates > 0) {
+        uintptr_t head = mAlloc.load();
+        while (!mAlloc.compare_exchange_weak(head, retag(head, nullptr))) {}
+
+        chunk *first = nullptr, *last = nullptr;
+        size_t batch = 0;
+        for (chunk *c = pointer(head), *next; c != nullptr; c = next) {
+            next = c->next;
+            block *owner = blockOf(c);
+            if (owner->candidate) {
+                if (owner->taken++ == 0) owner->takenFirst = c;
+                else owner->takenLast->next = c;
+                owner->takenLast = c;
+                continue;
+            }
+            if (last == nullptr) first = c;
+            else last->next = c;
+            last = c;
+            if (++batch == kTrimBatch) {
+                push(first, last);
+                first = last = nullptr;
+                batch = 0;
+            }
+        }
+        if (first != nullptr) push(first, last);
+
+        // unlink the released blocks, the others keep their order
+        block **link = &blocks;
+        lastBlock = nullptr;
+        while (block *b = *link) {
+            bool release = b->candidate && b->taken == chunksPerBlock;
+            if (b->candidate && !release && b->taken > 0) push(b->takenFirst, b->takenLast);
+            b->candidate = false;
+            b->taken = 0;
+            if (!release) {
+                lastBlock = b;
+                link = &b->next;
+                continue;
+            }
+            *link = b->next;
+            madvise(b, mapSize, MADV_DONTNEED);
+            mSpareBlocks.push_back(b);
+            released++;
+        }
+    }
+
+    if (lastBlock != nullptr) {
+        lastBlock->next = mBlocks.load(std::memory_order_relaxed);
+        while (!mBlocks.compare_exchange_weak(lastBlock->next, blocks, std::memory_order_release)) {}
+    }
+    countFree(-(ptrdiff_t)(released * chunksPerBlock));
+    mTrimAt.store(2 * (free - released * chunksPerBlock), std::memory_order_relaxed);
+    return released * mapSize;
+}
+
+
+/**
+ * @brief standard allocator on top of the pools, for node-based
+ containers: std::list, std::map and std::unordered_map allocate one node
+ at a time, and each node type gets a pool of its own.
+ * the adapter is stateless, all adapters of a type share its pool and
+ compare equal. arrays (the buckets of an unordered_map) are not chunks
+ and go to std::allocator.
+ */
 
-    // allocation pointer is now set to the returned (free) chunk;
-    chunk *malloc = reinterpret_cast<chunk*>(chunk_);
+template <typename T, size_t ChunksPerBlock = 64>
+struct PoolStlAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = PoolStlAllocator<U, ChunksPerBlock>;
+    };
+
+    PoolStlAllocator() = default;
+    template <typename U>
+    PoolStlAllocator(const PoolStlAllocator<U, ChunksPerBlock> &) {}
+
+    T *allocate(size_t n) {
+        if (n == 1) return pool().allocate();
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *ptr, size_t n) {
+        if (n == 1) return pool().deallocate(ptr);
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    /* the pool of this node type, shared by every container using it */
+    static PoolAllocator<T, ChunksPerBlock> &pool() {
+        static PoolAllocator<T, ChunksPerBlock> nodes;
+        return nodes;
+    }
+
+    template <typename U>
+    bool operator==(const PoolStlAllocator<U, ChunksPerBlock> &) const { return true; }
 };
 
 
@@ -123,32 +539,391 @@ void PoolAllocator::deallocate(void *chunk_, size_t size) {
 struct Object {
     uint64_t data[2];
 
-    static PoolAllocator allocator;
-    
+    // use 8 chunks per block
+    static PoolAllocator<Object, 8> allocator;
+
+    // a derived class may be larger than the chunks, it gets the heap
+    static void *operator new(size_t size) {
+        if (size != sizeof(Object)) return ::operator new(size);
+        return allocator.allocate();
+    }
+
+    static void operator delete(void *ptr, size_t size) {
+        if (size != sizeof(Object)) return ::operator delete(ptr);
+        allocator.deallocate(static_cast<Object *>(ptr));
+    }
+
+    /* creates 'n' objects at once, like new Object[n] but each object a
+       chunk of its own; deleteBatch() destroys them together */
+    static void newBatch(Object **objects, size_t n) {
+        allocator.allocateBatch(objects, n);
+        for (size_t i = 0; i < n; ++i) ::new (objects[i]) Object();
+    }
+
+    static void deleteBatch(Object **objects, size_t n) {
+        for (size_t i = 0; i < n; ++i) objects[i]->~Object();
+        allocator.deallocateBatch(objects, n);
+    }
+};
+
+PoolAllocator<Object, 8> Object::allocator;
+
+
+// Step 3: one pool serves one size. small objects of any size get a pool
+// through size classes: a request is rounded up to the next class and
+// served by that class's pool, larger ones go to the general heap. the
+// classes are 16 bytes apart up to 128, then four per power of two, so
+// rounding up wastes at most a quarter of a chunk above 128 bytes.
+
+constexpr size_t kSmallClassSizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+};
+constexpr int kSmallClasses = sizeof(kSmallClassSizes) / sizeof(kSmallClassSizes[0]);
+constexpr size_t kSmallMax = kSmallClassSizes[kSmallClasses - 1];
+constexpr size_t kSmallStep = 16;
+
+/* class of each size rounded up to the step, computed at compile time */
+constexpr auto kSizeClass = [] {
+    std::array<uint8_t, kSmallMax / kSmallStep + 1> table{};
+    int sizeClass = 0;
+    for (size_t i = 0; i < table.size(); ++i) {
+        while (kSmallClassSizes[sizeClass] < i * kSmallStep) ++sizeClass;
+        table[i] = sizeClass;
+    }
+    return table;
+}();
+
+constexpr int sizeClassOf(size_t size) {
+    return kSizeClass[(size + kSmallStep - 1) / kSmallStep];
+}
+
+/* chunk of a size class, aligned like malloc() memory */
+template <size_t Size>
+struct alignas(std::max_align_t) sizedChunk {
+    unsigned char bytes[Size];
+};
+
+/* the pool of each class: constant-initialized, so no guard on use */
+template <int SizeClass>
+constinit PoolAllocator<sizedChunk<kSmallClassSizes[SizeClass]>> classPool;
+
+template <int SizeClass>
+void *classAllocate() {
+    return classPool<SizeClass>.allocate();
+}
+
+template <int SizeClass>
+void classDeallocate(void *ptr) {
+    using Chunk = sizedChunk<kSmallClassSizes[SizeClass]>;
+    classPool<SizeClass>.deallocate(static_cast<Chunk *>(ptr));
+}
+
+template <int SizeClass>
+size_t classTrim() {
+    return classPool<SizeClass>.trim();
+}
+
+/* entry points of the pools, indexed by class */
+struct ClassTables {
+    std::array<void *(*)(), kSmallClasses> allocate;
+    std::array<void (*)(void *), kSmallClasses> deallocate;
+    std::array<size_t (*)(), kSmallClasses> trim;
+};
+
+template <size_t... Classes>
+constexpr ClassTables classTables(std::index_sequence<Classes...>) {
+    return {{&classAllocate<Classes>...}, {&classDeallocate<Classes>...}, {&classTrim<Classes>...}};
+}
+
+constexpr auto kClassTables = classTables(std::make_index_sequence<kSmallClasses>());
+
+/* allocates 'size' bytes from the pool of its class, or the heap */
+inline void *smallAllocate(size_t size) {
+    if (size > kSmallMax) return ::operator new(size);
+    return kClassTables.allocate[sizeClassOf(size)]();
+}
+
+/* frees memory of smallAllocate(), given the size it was asked for */
+inline void smallDeallocate(void *ptr, size_t size) {
+    if (size > kSmallMax) return ::operator delete(ptr);
+    kClassTables.deallocate[sizeClassOf(size)](ptr);
+}
+
+/* trims the pools of all classes, returns the bytes given back */
+inline size_t smallTrim() {
+    size_t released = 0;
+    for (auto trim : kClassTables.trim) released += trim();
+    return released;
+}
+
+/* base class: derived objects of any size come from the size classes */
+struct SmallObject {
     static void *operator new(size_t size) {
-        return allocator.allocate(size);
+        return smallAllocate(size);
     }
 
     static void operator delete(void *ptr, size_t size) {
-        return allocator.deallocate(ptr, size);
+        smallDeallocate(ptr, size);
     }
 };
 
-// use 8 chunks per block
-// PoolAllocator Object::allocator = 8;
 
+#include <assert.h>
+#include <list>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 int main(int argc, char const *argv[]) {
-    int arraySize = 10;
+    const int arraySize = 10;
     Object *object[arraySize];
 
     for (int i = 0; i < arraySize; ++i) {
         object[i] = new Object();
+        object[i]->data[0] = i;
     }
+    // chunks of one block are exactly one object apart
+    assert(reinterpret_cast<char *>(object[1]) - reinterpret_cast<char *>(object[0]) == sizeof(Object));
 
-    for (int i = arraySize; i >= 0; --i) {
+    for (int i = arraySize - 1; i >= 0; --i) {
+        assert(object[i]->data[0] == (uint64_t)i);
         delete object[i];
     } // thse are custom operatrors creating and deleting
+
+    // freed chunks are handed out again, the last freed first
+    Object *again = new Object();
+    assert(again == object[0]);
+    delete again;
+
+    static_assert(PoolAllocator<char, 4>::chunkSize == sizeof(chunk));
+    static_assert(PoolAllocator<Object>::chunkSize == sizeof(Object));
+    static_assert(PoolAllocator<long double>::chunkSize % alignof(long double) == 0);
+
+    // node-based containers take their nodes from the pools
+    std::list<int, PoolStlAllocator<int>> numbers;
+    for (int i = 0; i < 1000; ++i) numbers.push_back(i);
+    numbers.remove_if([](int n) { return n % 2; });
+    assert(numbers.size() == 500 && numbers.back() == 998);
+
+    using Entry = std::pair<const int, std::string>;
+    std::map<int, std::string, std::less<int>, PoolStlAllocator<Entry>> names;
+    std::unordered_map<int, std::string, std::hash<int>, std::equal_to<int>,
+                       PoolStlAllocator<Entry>> index;
+    for (int i = 0; i < 1000; ++i) {
+        names[i] = std::to_string(i);
+        index[i] = names[i];
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        names.erase(i);
+        index.erase(i);
+    }
+    assert(names.size() == 666 && index.size() == 666 && index.at(998) == "998");
+
+    // many threads hammer the same pool without a lock: no chunk is ever
+    // handed to two owners at once
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 8; ++t) {
+        workers.emplace_back([t] {
+            Object *live[64] = {};
+            unsigned rnd = t + 1;
+            for (int i = 0; i < 200000; ++i) {
+                rnd = rnd * 1103515245 + 12345;
+                Object *&slot = live[(rnd >> 8) % 64];
+                if (slot != nullptr) {
+                    assert(slot->data[0] == (uint64_t)t && slot->data[1] == (uint64_t)(&slot - live));
+                    delete slot;
+                }
+                slot = new Object();
+                slot->data[0] = t;
+                slot->data[1] = &slot - live;
+            }
+            for (Object *object : live) delete object;
+        });
+    }
+    for (auto &worker : workers) worker.join();
+
+    // trim: blocks whose chunks are all free go back, the others stay.
+    // blocks are whole pages, the chunks fill them
+    using Record = uint64_t[4];
+    using Records = PoolAllocator<Record, 16>;
+    static_assert(Records::mapSize == kPageSize && Records::chunksPerBlock >= 16);
+    constexpr size_t perBlock = Records::chunksPerBlock;
+    static Records records;
+    std::vector<Record *> held(3 * perBlock);
+    for (auto &record : held) record = records.allocate();
+    assert(records.freeChunks() == 0);
+    for (size_t i = 0; i < held.size(); ++i) {
+        if (i != perBlock + 4) records.deallocate(held[i]);
+    }
+    assert(records.freeChunks() == 3 * perBlock - 1);
+    assert(records.trim() == 2 * Records::mapSize);
+    assert(records.freeChunks() == perBlock - 1 && records.trim() == 0);
+    for (size_t i = 0; i < perBlock - 1; ++i) held[i] = records.allocate();
+    assert(records.freeChunks() == 0);
+    for (size_t i = 0; i < perBlock - 1; ++i) records.deallocate(held[i]);
+    records.deallocate(held[perBlock + 4]);
+    assert(records.trim() == Records::mapSize && records.freeChunks() == 0);
+
+    // blocks of three pages sit on a four-page alignment, chunks still
+    // find their block and whole blocks go back
+    using Wide = PoolAllocator<uint64_t[64], 20>;
+    static_assert(Wide::mapSize == 3 * kPageSize && Wide::blockAlign == 4 * kPageSize);
+    static Wide wide;
+    std::vector<uint64_t(*)[64]> spans(2 * Wide::chunksPerBlock);
+    for (auto &span : spans) span = wide.allocate();
+    for (size_t i = 1; i < spans.size(); ++i) wide.deallocate(spans[i]);
+    assert(wide.freeChunks() == spans.size() - 1);
+    assert(wide.trim() == Wide::mapSize && wide.freeChunks() == Wide::chunksPerBlock - 1);
+    wide.deallocate(spans[0]);
+    assert(wide.trim() == Wide::mapSize && wide.freeChunks() == 0);
+
+    // with a high watermark the pool trims itself, even while other
+    // threads allocate from it
+    records.trimAbove(64);
+    std::vector<std::thread> churners;
+    for (int t = 0; t < 4; ++t) {
+        churners.emplace_back([] {
+            Record *live[256];
+            for (int round = 0; round < 50; ++round) {
+                for (auto &record : live) {
+                    record = records.allocate();
+                    (*record)[0] = reinterpret_cast<uintptr_t>(record);
+                }
+                for (auto &record : live) {
+                    assert((*record)[0] == reinterpret_cast<uintptr_t>(record));
+                    records.deallocate(record);
+                }
+            }
+        });
+    }
+    for (auto &churner : churners) churner.join();
+    records.trim();
+    assert(records.freeChunks() <= 64);
+
+    // a trim that keeps most chunks raises the bar for the next one: frees
+    // in blocks that each keep a live chunk don't trim on every call
+    static Records sparse;
+    sparse.trimAbove(perBlock);
+    std::vector<Record *> scattered(8 * perBlock);
+    for (auto &record : scattered) record = sparse.allocate();
+    for (size_t i = 0; i < scattered.size(); ++i) {
+        if (i % perBlock != 0) sparse.deallocate(scattered[i]);
+    }
+    assert(sparse.freeChunks() == 8 * (perBlock - 1) && sparse.trim() == 0);
+    // nor when the last live chunks go: the pool waits for twice what the
+    // last trim kept, an explicit trim gives the blocks back
+    for (size_t i = 0; i < scattered.size(); i += perBlock) sparse.deallocate(scattered[i]);
+    assert(sparse.freeChunks() == 8 * perBlock);
+    assert(sparse.trim() == 8 * Records::mapSize && sparse.freeChunks() == 0);
+    // trimmed blocks are reused before new ones are mapped
+    Record *respawned = sparse.allocate();
+    assert(std::find(scattered.begin(), scattered.end(), respawned) != scattered.end());
+    sparse.deallocate(respawned);
+
+    // batches: a fresh pool carves them from contiguous blocks, and a
+    // freed batch comes back whole
+    static Records packets;
+    const size_t batchSize = 2 * perBlock + 8;
+    std::vector<Record *> batch(batchSize), refill(batchSize);
+    packets.allocateBatch(batch.data(), batchSize);
+    for (size_t i = 1; i < batchSize; ++i) {
+        if (i % perBlock != 0) assert(batch[i] == batch[i - 1] + 1);
+    }
+    assert(packets.freeChunks() == perBlock - 8);
+    packets.deallocateBatch(batch.data(), batchSize);
+    assert(packets.freeChunks() == 3 * perBlock);
+    packets.allocateBatch(refill.data(), batchSize);
+    assert(batch == refill && packets.freeChunks() == perBlock - 8);
+    packets.deallocateBatch(refill.data(), batchSize);
+
+    Object *group[100];
+    Object::newBatch(group, 100);
+    for (int i = 0; i < 100; ++i) group[i]->data[0] = i;
+    for (int i = 0; i < 100; ++i) assert(group[i]->data[0] == (uint64_t)i);
+    Object::deleteBatch(group, 100);
+
+    // batches and single chunks from many threads at once
+    std::vector<std::thread> batchers;
+    for (int t = 0; t < 4; ++t) {
+        batchers.emplace_back([t] {
+            Record *mine[100];
+            for (int round = 0; round < 2000; ++round) {
+                size_t n = 1 + (round * 7 + t) % 100;
+                if (t % 2) packets.allocateBatch(mine, n);
+                else for (size_t i = 0; i < n; ++i) mine[i] = packets.allocate();
+                for (size_t i = 0; i < n; ++i) (*mine[i])[0] = t;
+                for (size_t i = 0; i < n; ++i) assert((*mine[i])[0] == (uint64_t)t);
+                if (round % 3) packets.deallocateBatch(mine, n);
+                else for (size_t i = 0; i < n; ++i) packets.deallocate(mine[i]);
+            }
+        });
+    }
+    for (auto &batcher : batchers) batcher.join();
+
+    // cache-aligned chunks each start a line of their own, and prefaulted
+    // blocks come with their pages backed
+    static PoolAllocator<Object, 8, true> lines;
+    lines.prefault(true);
+    static_assert(decltype(lines)::chunkSize == kCacheLine);
+    Object *first = lines.allocate(), *second = lines.allocate();
+    assert(reinterpret_cast<uintptr_t>(first) % kCacheLine == 0);
+    assert(reinterpret_cast<char *>(second) - reinterpret_cast<char *>(first) == (ptrdiff_t)kCacheLine);
+    unsigned char resident = 0;
+    char *page = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(first) & ~(kPageSize - 1));
+    assert(mincore(page, kPageSize, &resident) == 0 && (resident & 1));
+    lines.deallocate(first);
+    lines.deallocate(second);
+
+    // a pool that goes out of scope unmaps its blocks, trimmed ones too
+    char *kept = nullptr, *trimmed = nullptr;
+    {
+        Records scoped;
+        std::vector<Record *> chunks(2 * perBlock);
+        for (auto &record : chunks) record = scoped.allocate();
+        for (size_t i = perBlock; i < chunks.size(); ++i) scoped.deallocate(chunks[i]);
+        assert(scoped.trim() == Records::mapSize);
+        kept = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(chunks[0]) & ~(kPageSize - 1));
+        trimmed = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(chunks[perBlock]) & ~(kPageSize - 1));
+    }
+    assert(mincore(kept, kPageSize, &resident) == -1 && mincore(trimmed, kPageSize, &resident) == -1);
+
+    // size classes: sizes round up to their class, each class has its pool
+    static_assert(sizeClassOf(0) == 0 && sizeClassOf(16) == 0 && sizeClassOf(17) == 1);
+    static_assert(sizeClassOf(129) == 8 && sizeClassOf(160) == 8 && sizeClassOf(512) == 15);
+    for (size_t size = 1; size <= kSmallMax; ++size) {
+        assert(kSmallClassSizes[sizeClassOf(size)] >= size);
+        assert(sizeClassOf(size) == 0 || kSmallClassSizes[sizeClassOf(size) - 1] < size);
+    }
+    void *small = smallAllocate(100);
+    assert(reinterpret_cast<uintptr_t>(small) % alignof(std::max_align_t) == 0);
+    smallDeallocate(small, 100);
+    assert(smallAllocate(112) == small);                    // same class, same chunk
+    void *other = smallAllocate(100);
+    assert(other != small);
+    smallDeallocate(other, 100);
+    smallDeallocate(small, 112);
+    void *large = smallAllocate(4096);
+    smallDeallocate(large, 4096);
+
+    struct Vertex : SmallObject {
+        double position[3], normal[3];
+        int id;
+    };
+    Vertex *vertices[100];
+    for (int i = 0; i < 100; ++i) {
+        vertices[i] = new Vertex();
+        vertices[i]->id = i;
+    }
+    for (int i = 0; i < 100; ++i) {
+        assert(vertices[i]->id == i);
+        delete vertices[i];
+    }
+    Vertex *reused = new Vertex();
+    assert(reused == vertices[99]);
+    delete reused;
+    assert(smallTrim() > 0);
 }
 
 // memory pool allows for fixed_size blocks of allocation